@@ -0,0 +1,388 @@
+// Rendering the scenes listed in a manifest on a pool of threads
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "batch.h"
+#include "scene.h"
+#include "parser.h"
+#include "scene_file.h"
+#include "image_formats.h"
+
+// BatchJob.stream_frame of jobs that aren't written to the standard
+// output
+#define NOT_STREAMED ((size_t) -1)
+
+struct BatchJob {
+  char *input;
+  char *output;
+  size_t stream_frame;   // position among the frames written to the standard output
+};
+
+struct Batch {
+  const struct BatchOptions *options;
+  struct SharedImages images;
+  struct BatchJob *jobs;
+  size_t num_jobs;
+  size_t next_job;   // next job to render (shared by the workers)
+  int num_failed;
+
+  // frames written to the standard output take turns, in the order
+  // of the manifest
+  pthread_mutex_t stream_lock;
+  pthread_cond_t stream_cond;
+  size_t next_stream_frame;
+};
+
+// A worker's background encoder. The worker and the encoder take
+// turns with two canvases: while one is being written out as a PNG,
+// the next scene is rendered onto the other.
+struct Encoder {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_t thread;
+  int started;       // the thread is running (otherwise frames are written directly)
+  int busy;          // a frame is waiting to be written, or being written
+  int quit;          // no more frames are coming
+  struct Image frame;      // the canvas being written
+  size_t frame_capacity;   // pixels allocated for it
+  const struct BatchJob *job;   // the job it was rendered for
+  struct Batch *batch;
+};
+
+static int is_space(char c) {
+  return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+// copy the next word before end, moving *pos past it; returns NULL
+// if there are no more words (or no memory)
+static char *next_word(const char *data, size_t end, size_t *pos) {
+  while (*pos < end && is_space(data[*pos])) {
+    (*pos)++;
+  }
+  size_t start = *pos;
+  while (*pos < end && !is_space(data[*pos])) {
+    (*pos)++;
+  }
+  return *pos > start ? strndup(data + start, *pos - start) : NULL;
+}
+
+// add a job, which takes ownership of the filenames; returns 0 on success
+static int add_job(struct Batch *batch, size_t *capacity, size_t *num_streamed,
+                   char *input, char *output) {
+  if (batch->num_jobs == *capacity) {
+    size_t new_capacity = *capacity ? *capacity * 2 : 64;
+    struct BatchJob *jobs = realloc(batch->jobs, new_capacity * sizeof(struct BatchJob));
+    if (jobs == NULL) {
+      return 1;
+    }
+    batch->jobs = jobs;
+    *capacity = new_capacity;
+  }
+  batch->jobs[batch->num_jobs].input = input;
+  batch->jobs[batch->num_jobs].output = output;
+  if (batch->options->raw_frame_format != 0 && strcmp(output, "-") == 0) {
+    batch->jobs[batch->num_jobs].stream_frame = (*num_streamed)++;
+  } else {
+    batch->jobs[batch->num_jobs].stream_frame = NOT_STREAMED;
+  }
+  batch->num_jobs++;
+  return 0;
+}
+
+static void free_jobs(struct Batch *batch) {
+  for (size_t i = 0; i < batch->num_jobs; i++) {
+    free(batch->jobs[i].input);
+    free(batch->jobs[i].output);
+  }
+  free(batch->jobs);
+}
+
+// read the manifest into batch->jobs; returns 0 on success
+static int read_manifest(const char *filename, struct Batch *batch) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Error: could not open manifest\n");
+    return 1;
+  }
+  struct Input input;
+  int rc = read_input(fd, &input);
+  close(fd);
+  if (rc != IMG_SUCCESS) {
+    fprintf(stderr, "Error: could not read manifest\n");
+    return 1;
+  }
+
+  size_t capacity = 0;
+  size_t num_streamed = 0;
+  size_t pos = 0;
+  int error = 0;
+  for (int line = 1; pos < input.size && !error; line++) {
+    size_t end = pos;
+    while (end < input.size && input.data[end] != '\n') {
+      end++;
+    }
+
+    // a third word means the line is invalid
+    char *words[3] = { NULL, NULL, NULL };
+    int num_words = 0;
+    while (num_words < 3 && (words[num_words] = next_word(input.data, end, &pos)) != NULL) {
+      num_words++;
+    }
+    if (num_words > 0 && words[0][0] != '#') {
+      if (num_words != 2) {
+        fprintf(stderr, "Error: invalid manifest line %d\n", line);
+        error = 1;
+      } else if (add_job(batch, &capacity, &num_streamed, words[0], words[1]) != 0) {
+        fprintf(stderr, "Error: could not read manifest\n");
+        error = 1;
+      } else {
+        words[0] = words[1] = NULL;
+      }
+    }
+    for (int i = 0; i < num_words; i++) {
+      free(words[i]);
+    }
+
+    pos = end + 1;
+  }
+
+  free_input(&input);
+  return error;
+}
+
+// render one scene onto its canvas, like c_draw does; returns 0 on
+// success
+static int render_job(struct Scene *scene, const struct BatchJob *job) {
+  int fd = open(job->input, O_RDONLY);
+  struct Input input;
+  if (fd < 0 || read_input(fd, &input) != IMG_SUCCESS) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    fprintf(stderr, "Error: could not read input\n");
+    return 1;
+  }
+  close(fd);
+
+  int error;
+  if (input.size >= 4 && memcmp(input.data, "CSFS", 4) == 0) {
+    free_input(&input);
+    error = read_scene_file(job->input, scene) != IMG_SUCCESS;
+    if (error) {
+      fprintf(stderr, "Error: invalid scene file\n");
+    }
+  } else {
+    error = parse_scene(input.data, input.size, scene);
+    free_input(&input);
+  }
+
+  if (!error) {
+    optimize_scene(scene);
+    // rendering can only fail while preparing the sprite atlases
+    if (render_scene(scene) != IMG_SUCCESS) {
+      error = 1;
+      if (scene->use_atlases) {
+        fprintf(stderr, "Error: could not create sprite atlas\n");
+      } else {
+        fprintf(stderr, "Error: could not render scene\n");
+      }
+    }
+  }
+  return error;
+}
+
+static void job_failed(struct Batch *batch, const struct BatchJob *job) {
+  fprintf(stderr, "Error: could not render %s\n", job->input);
+  __atomic_fetch_add(&batch->num_failed, 1, __ATOMIC_RELAXED);
+}
+
+// wait until it's a streamed job's turn to write its frame
+static void begin_stream_frame(struct Batch *batch, const struct BatchJob *job) {
+  pthread_mutex_lock(&batch->stream_lock);
+  while (batch->next_stream_frame != job->stream_frame) {
+    pthread_cond_wait(&batch->stream_cond, &batch->stream_lock);
+  }
+  pthread_mutex_unlock(&batch->stream_lock);
+}
+
+// let the next streamed job write its frame
+static void end_stream_frame(struct Batch *batch) {
+  pthread_mutex_lock(&batch->stream_lock);
+  batch->next_stream_frame++;
+  pthread_cond_broadcast(&batch->stream_cond);
+  pthread_mutex_unlock(&batch->stream_lock);
+}
+
+// a streamed job that failed still has to take its turn, so the
+// frames after it aren't held up (the stream just lacks its frame)
+static void skip_stream_frame(struct Batch *batch, const struct BatchJob *job) {
+  if (job->stream_frame != NOT_STREAMED) {
+    begin_stream_frame(batch, job);
+    end_stream_frame(batch);
+  }
+}
+
+static void write_frame(struct Batch *batch, const struct BatchJob *job, struct Image *frame) {
+  int format = batch->options->raw_frame_format;
+  int rc;
+  if (job->stream_frame != NOT_STREAMED) {
+    begin_stream_frame(batch, job);
+    rc = write_raw_frame(STDOUT_FILENO, frame, format);
+    end_stream_frame(batch);
+  } else if (format != 0) {
+    rc = write_raw_frame_file(job->output, frame, format);
+  } else {
+    rc = write_image(job->output, frame);
+  }
+  if (rc != IMG_SUCCESS) {
+    fprintf(stderr, "Error: could not write image\n");
+    job_failed(batch, job);
+  }
+}
+
+static void *encoder_thread(void *arg) {
+  struct Encoder *enc = arg;
+  pthread_mutex_lock(&enc->lock);
+  for (;;) {
+    while (!enc->busy && !enc->quit) {
+      pthread_cond_wait(&enc->cond, &enc->lock);
+    }
+    if (!enc->busy) {
+      break;
+    }
+    pthread_mutex_unlock(&enc->lock);
+    write_frame(enc->batch, enc->job, &enc->frame);
+    pthread_mutex_lock(&enc->lock);
+    enc->busy = 0;
+    pthread_cond_broadcast(&enc->cond);
+  }
+  pthread_mutex_unlock(&enc->lock);
+  return NULL;
+}
+
+static void start_encoder(struct Encoder *enc, struct Batch *batch) {
+  pthread_mutex_init(&enc->lock, NULL);
+  pthread_cond_init(&enc->cond, NULL);
+  enc->busy = 0;
+  enc->quit = 0;
+  enc->frame.width = 0;
+  enc->frame.height = 0;
+  enc->frame.data = NULL;
+  enc->frame_capacity = 0;
+  enc->job = NULL;
+  enc->batch = batch;
+  enc->started = pthread_create(&enc->thread, NULL, encoder_thread, enc) == 0;
+}
+
+// hand the scene's finished canvas to the encoder, giving the scene
+// the encoder's previous canvas to render the next scene on
+static void encode_canvas(struct Encoder *enc, struct Scene *scene, const struct BatchJob *job) {
+  if (!enc->started) {
+    write_frame(enc->batch, job, &scene->canvas);
+    return;
+  }
+  pthread_mutex_lock(&enc->lock);
+  while (enc->busy) {
+    pthread_cond_wait(&enc->cond, &enc->lock);
+  }
+  struct Image frame = enc->frame;
+  size_t frame_capacity = enc->frame_capacity;
+  enc->frame = scene->canvas;
+  enc->frame_capacity = scene->canvas_capacity;
+  scene->canvas = frame;
+  scene->canvas_capacity = frame_capacity;
+  enc->job = job;
+  enc->busy = 1;
+  pthread_cond_broadcast(&enc->cond);
+  pthread_mutex_unlock(&enc->lock);
+}
+
+// wait for the last frame to be written, and stop the encoder
+static void stop_encoder(struct Encoder *enc) {
+  if (enc->started) {
+    pthread_mutex_lock(&enc->lock);
+    enc->quit = 1;
+    pthread_cond_broadcast(&enc->cond);
+    pthread_mutex_unlock(&enc->lock);
+    pthread_join(enc->thread, NULL);
+  }
+  free(enc->frame.data);
+  pthread_cond_destroy(&enc->cond);
+  pthread_mutex_destroy(&enc->lock);
+}
+
+static void *batch_worker(void *arg) {
+  struct Batch *batch = arg;
+  struct Scene scene;
+  init_scene(&scene);
+  scene.use_atlases = batch->options->use_atlases;
+  scene.shared_images = &batch->images;
+  struct Encoder enc;
+  start_encoder(&enc, batch);
+
+  for (;;) {
+    size_t i = __atomic_fetch_add(&batch->next_job, 1, __ATOMIC_RELAXED);
+    if (i >= batch->num_jobs) {
+      break;
+    }
+    reset_scene(&scene);
+    if (render_job(&scene, &batch->jobs[i]) != 0) {
+      job_failed(batch, &batch->jobs[i]);
+      skip_stream_frame(batch, &batch->jobs[i]);
+    } else {
+      encode_canvas(&enc, &scene, &batch->jobs[i]);
+    }
+  }
+
+  stop_encoder(&enc);
+  free_scene(&scene);
+  return NULL;
+}
+
+int render_batch(const char *manifest_filename, const struct BatchOptions *options) {
+  struct Batch batch = {
+    .options = options,
+    .jobs = NULL,
+    .num_jobs = 0,
+    .next_job = 0,
+    .num_failed = 0,
+    .next_stream_frame = 0,
+  };
+  if (read_manifest(manifest_filename, &batch) != 0) {
+    free_jobs(&batch);
+    return -1;
+  }
+  init_shared_images(&batch.images, options->image_cache_dir);
+  pthread_mutex_init(&batch.stream_lock, NULL);
+  pthread_cond_init(&batch.stream_cond, NULL);
+
+  int num_threads = options->num_threads;
+  if ((size_t) num_threads > batch.num_jobs) {
+    num_threads = batch.num_jobs;
+  }
+  pthread_t *threads = malloc((num_threads > 1 ? num_threads - 1 : 1) * sizeof(pthread_t));
+  int num_started = 0;
+  if (threads != NULL) {
+    while (num_started < num_threads - 1
+           && pthread_create(&threads[num_started], NULL, batch_worker, &batch) == 0) {
+      num_started++;
+    }
+  }
+  // this thread is a worker too, so the batch gets done even if no
+  // threads could be started
+  batch_worker(&batch);
+  for (int i = 0; i < num_started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+
+  pthread_cond_destroy(&batch.stream_cond);
+  pthread_mutex_destroy(&batch.stream_lock);
+  free_shared_images(&batch.images);
+  free_jobs(&batch);
+  return batch.num_failed;
+}
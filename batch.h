@@ -0,0 +1,43 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+// Batch rendering: many scenes rendered by one process, listed in a
+// manifest file with one "input output" pair of filenames per line.
+// Inputs may be scene scripts or compiled scene files (see
+// scene_file.h). Blank lines and lines starting with '#' are ignored.
+//
+// The scenes are rendered by a pool of worker threads, each of which
+// renders one whole scene at a time, reusing its canvas and command
+// buffers from one scene to the next. Each worker has two canvases
+// and a background thread that writes out the image for one scene
+// while the worker renders the next scene on the other canvas, so a
+// worker keeps up to two CPUs busy. Images are loaded once and shared
+// by all of the scenes.
+//
+// Scenes can also be written as raw frames (see image_formats.h)
+// instead of image files. Then an output filename of "-" means the
+// standard output, and the frames written there come out in the
+// order of the manifest, so a whole animation can be piped into a
+// video encoder. (A scene that fails is left out of the stream.)
+
+// settings for render_batch
+struct BatchOptions {
+  int num_threads;               // number of workers (each with an encoder thread)
+  int use_atlases;               // like c_draw -p
+  const char *image_cache_dir;   // image cache (see image_cache.h), or NULL
+  int raw_frame_format;          // RAW_FRAME_* to write raw frames, or 0 for image files
+};
+
+// Render every scene in a manifest. Errors are reported on stderr,
+// and a scene that fails doesn't stop the others.
+//
+// Parameters:
+//   manifest_filename - name of the manifest file
+//   options           - pointer to BatchOptions
+//
+// Returns:
+//   the number of scenes that couldn't be rendered, or -1 if the
+//   manifest couldn't be read
+int render_batch(const char *manifest_filename, const struct BatchOptions *options);
+
+#endif // BATCH_H
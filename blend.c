@@ -0,0 +1,427 @@
+// Blending kernels for runs of pixels, with SSE2/AVX2 versions
+// picked at runtime
+
+#include <stddef.h>
+#include <stdint.h>
+#include "blend.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_KERNELS 1
+#include <immintrin.h>
+#else
+#define HAVE_X86_KERNELS 0
+#endif
+
+////////////////////////////////////////////////////////////////////////
+// Scalar kernels
+////////////////////////////////////////////////////////////////////////
+
+// (fg*a + bg*(255-a))/255 for one channel; x/255 is computed as
+// (x + 1 + (x >> 8)) >> 8, which is exact for every x <= 255*255
+static inline uint32_t blend_channel(uint32_t fg, uint32_t bg, uint32_t a) {
+	uint32_t x = fg * a + bg * (255 - a);
+	return (x + 1 + (x >> 8)) >> 8;
+}
+
+static inline uint32_t blend_pixel(uint32_t fg, uint32_t bg) {
+	uint32_t a = fg & 0xFF;
+	uint32_t r = blend_channel(fg >> 24, bg >> 24, a);
+	uint32_t g = blend_channel((fg >> 16) & 0xFF, (bg >> 16) & 0xFF, a);
+	uint32_t b = blend_channel((fg >> 8) & 0xFF, (bg >> 8) & 0xFF, a);
+	return (r << 24) | (g << 16) | (b << 8) | 0xFF;
+}
+
+static void blend_span_scalar(uint32_t *dst, const uint32_t *src, size_t n) {
+	for (size_t i = 0; i < n; i++) {
+		uint32_t a = src[i] & 0xFF;
+		if (a == 0xFF) {
+			dst[i] = src[i];
+		} else if (a == 0) {
+			dst[i] |= 0xFF;
+		} else {
+			dst[i] = blend_pixel(src[i], dst[i]);
+		}
+	}
+}
+
+static void blend_fill_scalar(uint32_t *dst, uint32_t color, size_t n) {
+	for (size_t i = 0; i < n; i++) {
+		dst[i] = blend_pixel(color, dst[i]);
+	}
+}
+
+static void solid_fill_scalar(uint32_t *dst, uint32_t color, size_t n) {
+	for (size_t i = 0; i < n; i++) {
+		dst[i] = color;
+	}
+}
+
+static void make_opaque_scalar(uint32_t *dst, size_t n) {
+	for (size_t i = 0; i < n; i++) {
+		dst[i] |= 0xFF;
+	}
+}
+
+// one channel of a premultiplied blend: (fg*a + bg*(255-a))/255 where
+// fg*a has already been computed
+static inline uint32_t premul_channel(uint32_t fg_times_a, uint32_t bg, uint32_t inv_a) {
+	uint32_t x = fg_times_a + bg * inv_a;
+	return (x + 1 + (x >> 8)) >> 8;
+}
+
+static void premul_span_scalar(uint32_t *dst, const uint64_t *src, size_t n) {
+	for (size_t i = 0; i < n; i++) {
+		uint64_t p = src[i];
+		uint32_t inv_a = p & 0xFFFF;
+		uint32_t bg = dst[i];
+		uint32_t r = premul_channel((p >> 48) & 0xFFFF, bg >> 24, inv_a);
+		uint32_t g = premul_channel((p >> 32) & 0xFFFF, (bg >> 16) & 0xFF, inv_a);
+		uint32_t b = premul_channel((p >> 16) & 0xFFFF, (bg >> 8) & 0xFF, inv_a);
+		dst[i] = (r << 24) | (g << 16) | (b << 8) | 0xFF;
+	}
+}
+
+#if HAVE_X86_KERNELS
+
+////////////////////////////////////////////////////////////////////////
+// SSE2 kernels
+//
+// In memory a pixel is the bytes A, B, G, R (the uint32_t is
+// 0xRRGGBBAA on a little endian machine), so after widening each
+// pixel occupies four 16 bit lanes with alpha in the lowest one.
+////////////////////////////////////////////////////////////////////////
+
+// blend two widened foreground pixels over two widened background pixels
+static inline __m128i blend2_sse2(__m128i fg, __m128i bg) {
+	const __m128i all_255 = _mm_set1_epi16(255);
+	const __m128i one = _mm_set1_epi16(1);
+
+	// broadcast each pixel's alpha lane to its other three lanes
+	__m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(fg, 0), 0);
+	__m128i inv_a = _mm_sub_epi16(all_255, a);
+
+	// fg*a + bg*(255-a) never exceeds 255*255, so it fits in 16 bits
+	__m128i x = _mm_add_epi16(_mm_mullo_epi16(fg, a), _mm_mullo_epi16(bg, inv_a));
+	x = _mm_add_epi16(x, _mm_add_epi16(one, _mm_srli_epi16(x, 8)));
+	return _mm_srli_epi16(x, 8);
+}
+
+// blend four foreground pixels over four background pixels
+static inline __m128i blend4_sse2(__m128i fg, __m128i bg) {
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i opaque = _mm_set1_epi32(0xFF);
+
+	__m128i lo = blend2_sse2(_mm_unpacklo_epi8(fg, zero), _mm_unpacklo_epi8(bg, zero));
+	__m128i hi = blend2_sse2(_mm_unpackhi_epi8(fg, zero), _mm_unpackhi_epi8(bg, zero));
+	return _mm_or_si128(_mm_packus_epi16(lo, hi), opaque);
+}
+
+static void blend_span_sse2(uint32_t *dst, const uint32_t *src, size_t n) {
+	const __m128i alpha = _mm_set1_epi32(0xFF);
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128i fg = _mm_loadu_si128((const __m128i *) (src + i));
+		__m128i fg_a = _mm_and_si128(fg, alpha);
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(fg_a, alpha)) == 0xFFFF) {
+			// all four opaque: plain copy
+			_mm_storeu_si128((__m128i *) (dst + i), fg);
+			continue;
+		}
+
+		__m128i bg = _mm_loadu_si128((const __m128i *) (dst + i));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(fg_a, _mm_setzero_si128())) == 0xFFFF) {
+			// all four fully transparent: background only gains opaque alpha
+			_mm_storeu_si128((__m128i *) (dst + i), _mm_or_si128(bg, alpha));
+		} else {
+			_mm_storeu_si128((__m128i *) (dst + i), blend4_sse2(fg, bg));
+		}
+	}
+	blend_span_scalar(dst + i, src + i, n - i);
+}
+
+static void blend_fill_sse2(uint32_t *dst, uint32_t color, size_t n) {
+	size_t i = 0;
+	__m128i fg = _mm_set1_epi32((int) color);
+	for (; i + 4 <= n; i += 4) {
+		__m128i bg = _mm_loadu_si128((const __m128i *) (dst + i));
+		_mm_storeu_si128((__m128i *) (dst + i), blend4_sse2(fg, bg));
+	}
+	blend_fill_scalar(dst + i, color, n - i);
+}
+
+static void solid_fill_sse2(uint32_t *dst, uint32_t color, size_t n) {
+	size_t i = 0;
+	__m128i fg = _mm_set1_epi32((int) color);
+	for (; i + 4 <= n; i += 4) {
+		_mm_storeu_si128((__m128i *) (dst + i), fg);
+	}
+	solid_fill_scalar(dst + i, color, n - i);
+}
+
+static void make_opaque_sse2(uint32_t *dst, size_t n) {
+	size_t i = 0;
+	const __m128i alpha = _mm_set1_epi32(0xFF);
+	for (; i + 4 <= n; i += 4) {
+		__m128i bg = _mm_loadu_si128((const __m128i *) (dst + i));
+		_mm_storeu_si128((__m128i *) (dst + i), _mm_or_si128(bg, alpha));
+	}
+	make_opaque_scalar(dst + i, n - i);
+}
+
+// blend two premultiplied pixels over two widened background pixels:
+// lane 0 of each premultiplied pixel is 255-a, so a single multiply
+// by the broadcast lane 0 finishes every channel
+static inline __m128i premul2_sse2(__m128i premul, __m128i bg) {
+	const __m128i one = _mm_set1_epi16(1);
+	__m128i inv_a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(premul, 0), 0);
+	__m128i x = _mm_add_epi16(premul, _mm_mullo_epi16(bg, inv_a));
+	x = _mm_add_epi16(x, _mm_add_epi16(one, _mm_srli_epi16(x, 8)));
+	return _mm_srli_epi16(x, 8);
+}
+
+static void premul_span_sse2(uint32_t *dst, const uint64_t *src, size_t n) {
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i opaque = _mm_set1_epi32(0xFF);
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128i bg = _mm_loadu_si128((const __m128i *) (dst + i));
+		__m128i lo = premul2_sse2(_mm_loadu_si128((const __m128i *) (src + i)),
+		                          _mm_unpacklo_epi8(bg, zero));
+		__m128i hi = premul2_sse2(_mm_loadu_si128((const __m128i *) (src + i + 2)),
+		                          _mm_unpackhi_epi8(bg, zero));
+		_mm_storeu_si128((__m128i *) (dst + i), _mm_or_si128(_mm_packus_epi16(lo, hi), opaque));
+	}
+	premul_span_scalar(dst + i, src + i, n - i);
+}
+
+////////////////////////////////////////////////////////////////////////
+// AVX2 kernels (same math as SSE2, eight pixels at a time)
+////////////////////////////////////////////////////////////////////////
+
+// blend four widened foreground pixels over four widened background pixels
+__attribute__((target("avx2")))
+static inline __m256i blend4_avx2(__m256i fg, __m256i bg) {
+	const __m256i all_255 = _mm256_set1_epi16(255);
+	const __m256i one = _mm256_set1_epi16(1);
+
+	__m256i a = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(fg, 0), 0);
+	__m256i inv_a = _mm256_sub_epi16(all_255, a);
+
+	__m256i x = _mm256_add_epi16(_mm256_mullo_epi16(fg, a), _mm256_mullo_epi16(bg, inv_a));
+	x = _mm256_add_epi16(x, _mm256_add_epi16(one, _mm256_srli_epi16(x, 8)));
+	return _mm256_srli_epi16(x, 8);
+}
+
+// blend eight foreground pixels over eight background pixels
+__attribute__((target("avx2")))
+static inline __m256i blend8_avx2(__m256i fg, __m256i bg) {
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i opaque = _mm256_set1_epi32(0xFF);
+
+	// unpack/pack work within 128 bit lanes, so pixel order is preserved
+	__m256i lo = blend4_avx2(_mm256_unpacklo_epi8(fg, zero), _mm256_unpacklo_epi8(bg, zero));
+	__m256i hi = blend4_avx2(_mm256_unpackhi_epi8(fg, zero), _mm256_unpackhi_epi8(bg, zero));
+	return _mm256_or_si256(_mm256_packus_epi16(lo, hi), opaque);
+}
+
+__attribute__((target("avx2")))
+static void blend_span_avx2(uint32_t *dst, const uint32_t *src, size_t n) {
+	const __m256i alpha = _mm256_set1_epi32(0xFF);
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256i fg = _mm256_loadu_si256((const __m256i *) (src + i));
+		__m256i fg_a = _mm256_and_si256(fg, alpha);
+
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(fg_a, alpha)) == -1) {
+			_mm256_storeu_si256((__m256i *) (dst + i), fg);
+			continue;
+		}
+
+		__m256i bg = _mm256_loadu_si256((const __m256i *) (dst + i));
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(fg_a, _mm256_setzero_si256())) == -1) {
+			_mm256_storeu_si256((__m256i *) (dst + i), _mm256_or_si256(bg, alpha));
+		} else {
+			_mm256_storeu_si256((__m256i *) (dst + i), blend8_avx2(fg, bg));
+		}
+	}
+	blend_span_sse2(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void blend_fill_avx2(uint32_t *dst, uint32_t color, size_t n) {
+	size_t i = 0;
+	__m256i fg = _mm256_set1_epi32((int) color);
+	for (; i + 8 <= n; i += 8) {
+		__m256i bg = _mm256_loadu_si256((const __m256i *) (dst + i));
+		_mm256_storeu_si256((__m256i *) (dst + i), blend8_avx2(fg, bg));
+	}
+	blend_fill_sse2(dst + i, color, n - i);
+}
+
+__attribute__((target("avx2")))
+static void solid_fill_avx2(uint32_t *dst, uint32_t color, size_t n) {
+	size_t i = 0;
+	__m256i fg = _mm256_set1_epi32((int) color);
+	for (; i + 8 <= n; i += 8) {
+		_mm256_storeu_si256((__m256i *) (dst + i), fg);
+	}
+	solid_fill_sse2(dst + i, color, n - i);
+}
+
+__attribute__((target("avx2")))
+static void make_opaque_avx2(uint32_t *dst, size_t n) {
+	size_t i = 0;
+	const __m256i alpha = _mm256_set1_epi32(0xFF);
+	for (; i + 8 <= n; i += 8) {
+		__m256i bg = _mm256_loadu_si256((const __m256i *) (dst + i));
+		_mm256_storeu_si256((__m256i *) (dst + i), _mm256_or_si256(bg, alpha));
+	}
+	make_opaque_sse2(dst + i, n - i);
+}
+
+// blend four premultiplied pixels over four background pixels
+__attribute__((target("avx2")))
+static inline __m128i premul4_avx2(__m256i premul, __m128i bg) {
+	const __m256i one = _mm256_set1_epi16(1);
+	// widening a 128 bit load keeps the pixels in order across both lanes
+	__m256i bg16 = _mm256_cvtepu8_epi16(bg);
+	__m256i inv_a = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(premul, 0), 0);
+	__m256i x = _mm256_add_epi16(premul, _mm256_mullo_epi16(bg16, inv_a));
+	x = _mm256_add_epi16(x, _mm256_add_epi16(one, _mm256_srli_epi16(x, 8)));
+	x = _mm256_srli_epi16(x, 8);
+	return _mm_packus_epi16(_mm256_castsi256_si128(x), _mm256_extracti128_si256(x, 1));
+}
+
+__attribute__((target("avx2")))
+static void premul_span_avx2(uint32_t *dst, const uint64_t *src, size_t n) {
+	const __m128i opaque = _mm_set1_epi32(0xFF);
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128i bg = _mm_loadu_si128((const __m128i *) (dst + i));
+		__m128i result = premul4_avx2(_mm256_loadu_si256((const __m256i *) (src + i)), bg);
+		_mm_storeu_si128((__m128i *) (dst + i), _mm_or_si128(result, opaque));
+	}
+	premul_span_scalar(dst + i, src + i, n - i);
+}
+
+#endif // HAVE_X86_KERNELS
+
+////////////////////////////////////////////////////////////////////////
+// Runtime dispatch
+////////////////////////////////////////////////////////////////////////
+
+// one set of kernels per BLEND_KERNEL_* value
+struct BlendKernels {
+	void (*span)(uint32_t *dst, const uint32_t *src, size_t n);
+	void (*fill)(uint32_t *dst, uint32_t color, size_t n);
+	// color is opaque: the result is just color
+	void (*solid_fill)(uint32_t *dst, uint32_t color, size_t n);
+	// color is fully transparent: only the alpha of dst changes
+	void (*make_opaque)(uint32_t *dst, size_t n);
+	void (*premul_span)(uint32_t *dst, const uint64_t *src, size_t n);
+};
+
+static const struct BlendKernels scalar_kernels = {
+	blend_span_scalar, blend_fill_scalar, solid_fill_scalar, make_opaque_scalar,
+	premul_span_scalar
+};
+#if HAVE_X86_KERNELS
+static const struct BlendKernels sse2_kernels = {
+	blend_span_sse2, blend_fill_sse2, solid_fill_sse2, make_opaque_sse2,
+	premul_span_sse2
+};
+static const struct BlendKernels avx2_kernels = {
+	blend_span_avx2, blend_fill_avx2, solid_fill_avx2, make_opaque_avx2,
+	premul_span_avx2
+};
+#endif
+
+static int blend_kernel = BLEND_KERNEL_SCALAR;
+static const struct BlendKernels *kernels = &scalar_kernels;
+
+static int blend_kernel_supported(int kernel) {
+	switch (kernel) {
+	case BLEND_KERNEL_SCALAR:
+		return 1;
+#if HAVE_X86_KERNELS
+	case BLEND_KERNEL_SSE2:
+		return __builtin_cpu_supports("sse2");
+	case BLEND_KERNEL_AVX2:
+		return __builtin_cpu_supports("avx2");
+#endif
+	default:
+		return 0;
+	}
+}
+
+int blend_set_kernel(int kernel) {
+	if (kernel > BLEND_KERNEL_AVX2) {
+		kernel = BLEND_KERNEL_AVX2;
+	}
+	while (kernel > BLEND_KERNEL_SCALAR && !blend_kernel_supported(kernel)) {
+		kernel--;
+	}
+
+	switch (kernel) {
+#if HAVE_X86_KERNELS
+	case BLEND_KERNEL_AVX2:
+		kernels = &avx2_kernels;
+		break;
+	case BLEND_KERNEL_SSE2:
+		kernels = &sse2_kernels;
+		break;
+#endif
+	default:
+		kernel = BLEND_KERNEL_SCALAR;
+		kernels = &scalar_kernels;
+		break;
+	}
+
+	blend_kernel = kernel;
+	return kernel;
+}
+
+int blend_get_kernel(void) {
+	return blend_kernel;
+}
+
+// pick the best kernel before main() runs, so the kernel table
+// is never switched while other threads might be drawing
+__attribute__((constructor))
+static void blend_init(void) {
+	__builtin_cpu_init();
+	blend_set_kernel(BLEND_KERNEL_AVX2);
+}
+
+void blend_span(uint32_t *dst, const uint32_t *src, size_t n) {
+	kernels->span(dst, src, n);
+}
+
+void blend_fill(uint32_t *dst, uint32_t color, size_t n) {
+	// an opaque color replaces the background outright, and a fully
+	// transparent one leaves every color channel alone
+	switch (color & 0xFF) {
+	case 0xFF:
+		kernels->solid_fill(dst, color, n);
+		break;
+	case 0:
+		kernels->make_opaque(dst, n);
+		break;
+	default:
+		kernels->fill(dst, color, n);
+		break;
+	}
+}
+
+uint64_t premultiply_pixel(uint32_t color) {
+	uint64_t a = color & 0xFF;
+	uint64_t r = (color >> 24) * a;
+	uint64_t g = ((color >> 16) & 0xFF) * a;
+	uint64_t b = ((color >> 8) & 0xFF) * a;
+	return (r << 48) | (g << 32) | (b << 16) | (255 - a);
+}
+
+void blend_span_premul(uint32_t *dst, const uint64_t *src, size_t n) {
+	kernels->premul_span(dst, src, n);
+}
@@ -0,0 +1,69 @@
+#ifndef BLEND_H
+#define BLEND_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Kernels that blend_span and blend_fill can be dispatched to.
+// The best one supported by the CPU is picked at startup.
+#define BLEND_KERNEL_SCALAR  0
+#define BLEND_KERNEL_SSE2    1
+#define BLEND_KERNEL_AVX2    2
+
+// Blend a run of foreground pixels over a run of background pixels.
+// Every destination pixel becomes exactly what blend_colors(src[i], dst[i])
+// would produce, i.e. (fg*a + bg*(255-a))/255 per channel with an
+// opaque alpha. Runs of opaque foreground pixels are copied and runs
+// of fully transparent ones only set the background alpha to 255.
+//
+// Parameters:
+//   dst - pointer to the first background pixel (updated in place)
+//   src - pointer to the first foreground pixel
+//   n - number of pixels
+void blend_span(uint32_t *dst, const uint32_t *src, size_t n);
+
+// Blend a single foreground color over a run of background pixels.
+// Equivalent to calling blend_span with a src run filled with color;
+// an opaque color turns into a plain vectorized fill.
+//
+// Parameters:
+//   dst - pointer to the first background pixel (updated in place)
+//   color - foreground color
+//   n - number of pixels
+void blend_fill(uint32_t *dst, uint32_t color, size_t n);
+
+// Convert a color to premultiplied form: four 16 bit fields holding
+// (from least to most significant) 255-a, b*a, g*a and r*a.
+//
+// Parameters:
+//   color - color to convert
+//
+// Returns:
+//   the premultiplied pixel
+uint64_t premultiply_pixel(uint32_t color);
+
+// Blend a run of premultiplied pixels (see premultiply_pixel) over a
+// run of background pixels. The result is identical to blend_span on
+// the original colors, but each channel needs only one multiply.
+//
+// Parameters:
+//   dst - pointer to the first background pixel (updated in place)
+//   src - pointer to the first premultiplied pixel
+//   n - number of pixels
+void blend_span_premul(uint32_t *dst, const uint64_t *src, size_t n);
+
+// Returns the BLEND_KERNEL_* value currently in use.
+int blend_get_kernel(void);
+
+// Select the kernel used by blend_span and blend_fill. If the CPU
+// does not support the requested kernel, the best supported kernel
+// below it is used instead.
+//
+// Parameters:
+//   kernel - one of the BLEND_KERNEL_* values
+//
+// Returns:
+//   the BLEND_KERNEL_* value that was actually selected
+int blend_set_kernel(int kernel);
+
+#endif // BLEND_H
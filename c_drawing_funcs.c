@@ -2,12 +2,15 @@
 
 #include <assert.h>
 // #include <cstdint>
+#include <math.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/ucontext.h>
 #include "drawing_funcs.h"
+#include "blend.h"
 
 ////////////////////////////////////////////////////////////////////////
 // Helper functions
@@ -93,12 +96,7 @@ uint8_t blend_color(uint8_t fg, uint8_t bg, uint8_t opacity){
 }
 
 uint32_t make_color(uint8_t r, uint8_t g, uint8_t b){
-	uint32_t newColor = 0;
-	newColor = set_r(newColor, r);
-	newColor = set_g(newColor, g);
-	newColor = set_b(newColor, b);
-	newColor = set_a(newColor, 255);
-	return newColor;
+	return ((uint32_t) r << 24) | ((uint32_t) g << 16) | ((uint32_t) b << 8) | 0xFF;
 }
 
 uint32_t blend_colors(uint32_t fg, uint32_t bg){
@@ -132,6 +130,23 @@ int64_t square_dist(int64_t x1, int64_t y1, int64_t x2, int64_t y2){
 	return square(x2-x1) + square(y2-y1);
 }
 
+//returns the largest n such that n*n <= x
+//returns 0 if x is negative
+int64_t isqrt(int64_t x){
+	if(x <= 0){
+		return 0;
+	}
+	// sqrt() gets within one of the answer, then correct for rounding
+	int64_t n = (int64_t) sqrt((double) x);
+	while(n * n > x){
+		n--;
+	}
+	while((n + 1) * (n + 1) <= x){
+		n++;
+	}
+	return n;
+}
+
 //checks if a pixel is contained in a circle(inclusive) and if so
 //returns 1 = contained
 //returns 0 = outside the circle
@@ -170,6 +185,40 @@ int rect_in_img(struct Image* image, const struct Rect* rect){
 	return 0;
 }
 
+//clips rect against the bounds of image and stores the covered
+//region in clipped
+//returns 1 if the clipped region contains at least one pixel
+//returns 0 if the rectangle is entirely outside the image
+int clip_rect(struct Image* image, const struct Rect* rect, struct Rect* clipped){
+	// 64 bit so that x + width can't overflow
+	int64_t x_start = rect->x;
+	int64_t y_start = rect->y;
+	int64_t x_end = x_start + rect->width;
+	int64_t y_end = y_start + rect->height;
+
+	if(x_start < 0){
+		x_start = 0;
+	}
+	if(y_start < 0){
+		y_start = 0;
+	}
+	if(x_end > image->width){
+		x_end = image->width;
+	}
+	if(y_end > image->height){
+		y_end = image->height;
+	}
+	if(x_end <= x_start || y_end <= y_start){
+		return 0;
+	}
+
+	clipped->x = x_start;
+	clipped->y = y_start;
+	clipped->width = x_end - x_start;
+	clipped->height = y_end - y_start;
+	return 1;
+}
+
 void draw_pixel_no_blending(struct Image *img, int32_t x, int32_t y, uint32_t color){
 	if(!in_bounds(img, x, y)){
 		return;
@@ -213,12 +262,13 @@ void draw_pixel(struct Image *img, int32_t x, int32_t y, uint32_t color) {
 void draw_rect(struct Image *img,
                const struct Rect *rect,
                uint32_t color) {
-	for(int i = 0; i < img->width; i++){
-		for(int j = 0; j < img->height; j++){
-			if(is_in_rect(img, rect, i, j)){
-				draw_pixel(img, i, j, color);
-			}
-		}
+	struct Rect clipped;
+	if(!clip_rect(img, rect, &clipped)){
+		return;
+	}
+	// only visit the rows the rectangle actually covers
+	for(int32_t j = clipped.y; j < clipped.y + clipped.height; j++){
+		blend_fill(img->data + compute_index(img, clipped.x, j), color, clipped.width);
 	}
 }
 
@@ -236,13 +286,31 @@ void draw_rect(struct Image *img,
 void draw_circle(struct Image *img,
                  int32_t x, int32_t y, int32_t r,
                  uint32_t color) {
-	for(int i = 0; i < img->width; i++){
-		for(int j = 0; j < img->height; j++){
-			if(is_in_circle(img, x, y, i, j, r)){
-				uint32_t index = compute_index(img, i, j);
-				uint32_t newColor = blend_colors(color, img->data[index]);
-				set_pixel(img, index, newColor);
-			}
+	// a pixel is inside when dx*dx + dy*dy <= r*r, so every row of the
+	// circle is a single span of half width isqrt(r*r - dy*dy)
+	int64_t r_sq = square(r);
+	int64_t extent = isqrt(r_sq);
+	int64_t y_start = (int64_t) y - extent;
+	int64_t y_end = (int64_t) y + extent;
+	if(y_start < 0){
+		y_start = 0;
+	}
+	if(y_end > (int64_t) img->height - 1){
+		y_end = (int64_t) img->height - 1;
+	}
+
+	for(int64_t j = y_start; j <= y_end; j++){
+		int64_t half_width = isqrt(r_sq - square(j - y));
+		int64_t x_start = (int64_t) x - half_width;
+		int64_t x_end = (int64_t) x + half_width;
+		if(x_start < 0){
+			x_start = 0;
+		}
+		if(x_end > (int64_t) img->width - 1){
+			x_end = (int64_t) img->width - 1;
+		}
+		if(x_start <= x_end){
+			blend_fill(img->data + compute_index(img, x_start, j), color, x_end - x_start + 1);
 		}
 	}
 }
@@ -268,15 +336,20 @@ void draw_tile(struct Image *img,
 	if(!rect_in_img(tilemap, tile)){
 		return;
 	}
-	for(uint32_t i = 0; i < tile->width; i++){
-		for(uint32_t j = 0; j < tile->height; j++){
-			if(in_bounds(img, x+i, j+y) && in_bounds(tilemap, i+tile->x, j+tile->y)){
-				uint32_t tilemap_index = compute_index(tilemap, i+tile->x, j+tile->y);
-				draw_pixel_no_blending(img, x+i, j+y, tilemap->data[tilemap_index]);
-			}
-		}
+	struct Rect dest = { .x = x, .y = y, .width = tile->width, .height = tile->height };
+	struct Rect clipped;
+	if(!clip_rect(img, &dest, &clipped)){
+		return;
+	}
+	// where the clipped region starts within the tilemap
+	int32_t src_x = tile->x + ((int64_t) clipped.x - x);
+	int32_t src_y = tile->y + ((int64_t) clipped.y - y);
+	// no blending, so every row is a straight copy
+	for(int32_t j = 0; j < clipped.height; j++){
+		memcpy(img->data + compute_index(img, clipped.x, clipped.y + j),
+		       tilemap->data + compute_index(tilemap, src_x, src_y + j),
+		       clipped.width * sizeof(uint32_t));
 	}
-
 }
 
 //
@@ -301,12 +374,17 @@ void draw_sprite(struct Image *img,
 	if(!rect_in_img(spritemap, sprite)){
 		return;
 	}
-	for(uint32_t i = 0; i < sprite->width; i++){
-		for(uint32_t j = 0; j < sprite->height; j++){
-			if(in_bounds(img, x+i, j+y) && in_bounds(spritemap, i+sprite->x, j+sprite->y)){
-        uint32_t sprite_index = compute_index(spritemap, i+sprite->x, j+sprite->y);
-				draw_pixel(img, x+i, j+y, spritemap->data[sprite_index]);
-			}
-		}
+	struct Rect dest = { .x = x, .y = y, .width = sprite->width, .height = sprite->height };
+	struct Rect clipped;
+	if(!clip_rect(img, &dest, &clipped)){
+		return;
+	}
+	// where the clipped region starts within the spritemap
+	int32_t src_x = sprite->x + ((int64_t) clipped.x - x);
+	int32_t src_y = sprite->y + ((int64_t) clipped.y - y);
+	for(int32_t j = 0; j < clipped.height; j++){
+		blend_span(img->data + compute_index(img, clipped.x, clipped.y + j),
+		           spritemap->data + compute_index(spritemap, src_x, src_y + j),
+		           clipped.width);
 	}
 }
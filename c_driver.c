@@ -6,144 +6,183 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
-#include <ctype.h>
+#include <string.h>
+#include <unistd.h>
 #include "image.h"
 #include "drawing_funcs.h"
+#include "scene.h"
+#include "parser.h"
+#include "scene_file.h"
+#include "batch.h"
+#include "image_formats.h"
 
-#define NUM_IMAGE_SLOTS 8
-
-void skipws(FILE *in) {
-  for (;;) {
-    int c = fgetc(in);
-    if (c < 0) {
+int main(int argc, char **argv) {
+  // -p: convert spritemaps to premultiplied atlases and draw
+  // sprites with draw_sprite_premul
+  // -j N: render and compress the output with N threads
+  // -b FILE: render a compiled scene file (see scene_compile) instead
+  // of reading a script from stdin
+  // -z LEVEL: compress the output with zlib level 0-9
+  // -i: write an indexed (palette) PNG if the image has at most 256
+  // colors
+  // -c DIR: keep decoded images in DIR, so later runs can skip
+  // decoding them (see image_cache.h)
+  // -m MANIFEST: render every scene listed in MANIFEST (see batch.h),
+  // with -j N workers (by default, one per two CPUs, since each one
+  // writes out a scene while it renders the next); no output
+  // filename is given
+  // -r FORMAT: write the canvas as a raw frame (rgba, rgb or abgr; see
+  // image_formats.h) instead of an image file, for piping into a
+  // video encoder; an output filename of "-" means the standard output
+  int use_atlases = 0;
+  const char *scene_filename = NULL;
+  const char *cache_dir = NULL;
+  const char *manifest_filename = NULL;
+  int num_threads = 0;
+  int raw_frame_format = 0;
+  int opt;
+  char *end;
+  opterr = 0;
+  while ((opt = getopt(argc, argv, "pj:b:z:ic:m:r:")) != -1) {
+    switch (opt) {
+    case 'p':
+      use_atlases = 1;
+      break;
+    case 'j': {
+      long n = strtol(optarg, &end, 10);
+      if (*end != '\0' || n < 1 || n > 1024) {
+        fprintf(stderr, "Error: invalid command line arguments\n");
+        return 1;
+      }
+      num_threads = n;
       break;
     }
-    if (!isspace(c)) {
-      ungetc(c, in);
+    case 'b':
+      scene_filename = optarg;
+      break;
+    case 'i':
+      set_image_palette(1);
+      break;
+    case 'c':
+      cache_dir = optarg;
+      break;
+    case 'm':
+      manifest_filename = optarg;
+      break;
+    case 'r':
+      raw_frame_format = raw_frame_format_for_name(optarg);
+      if (raw_frame_format == 0) {
+        fprintf(stderr, "Error: invalid command line arguments\n");
+        return 1;
+      }
+      break;
+    case 'z': {
+      long level = strtol(optarg, &end, 10);
+      if (*end != '\0' || end == optarg || level < 0 || level > 9) {
+        fprintf(stderr, "Error: invalid command line arguments\n");
+        return 1;
+      }
+      set_image_compression_level(level);
       break;
     }
+    default:
+      fprintf(stderr, "Error: invalid command line arguments\n");
+      return 1;
+    }
   }
-}
-
-int main(int argc, char **argv) {
-  if (argc != 2) {
+  if (manifest_filename != NULL) {
+    if (argc - optind != 0 || scene_filename != NULL) {
+      fprintf(stderr, "Error: invalid command line arguments\n");
+      return 1;
+    }
+    struct BatchOptions options = {
+      .num_threads = num_threads > 0 ? num_threads : sysconf(_SC_NPROCESSORS_ONLN) / 2,
+      .use_atlases = use_atlases,
+      .image_cache_dir = cache_dir,
+      .raw_frame_format = raw_frame_format,
+    };
+    if (options.num_threads < 1) {
+      options.num_threads = 1;
+    }
+    return render_batch(manifest_filename, &options) != 0;
+  }
+  if (num_threads == 0) {
+    num_threads = 1;
+  }
+  set_image_threads(num_threads);
+  if (argc - optind != 1) {
     fprintf(stderr, "Error: invalid command line arguments\n");
     return 1;
   }
+  const char *output_filename = argv[optind];
 
-  struct Image canvas = {
-    .data = NULL,
-    .width = 0,
-    .height = 0,
-  };
-
-  struct Image loaded_images[NUM_IMAGE_SLOTS] = {{0,0,NULL}};
-  uint32_t width, height;
-  char cmd;
-  struct Rect rect;
-  uint32_t color;
-  int32_t x, y, r, n;
-  char filename[256];
+  struct Scene scene;
+  init_scene(&scene);
+  scene.use_atlases = use_atlases;
+  scene.image_cache_dir = cache_dir;
 
   int error = 0;
-
-  while (!error && scanf(" %c", &cmd) == 1) {
-    switch (cmd) {
-    case 'S': // "Size", must be the first command
-      if (scanf("%u %u", &width, &height) != 2) {
-        error = 1;
-        fprintf(stderr, "Error: invalid C command\n");
-        break;
-      }
-      if (init_image(&canvas, width, height) != IMG_SUCCESS) {
-        error = 1;
-        fprintf(stderr, "Error: could not create canvas\n");
-      }
-      break;
-
-    case 'R': // "Rectangle"
-      if (canvas.data == NULL) {
-        error = 1;
-        fprintf(stderr, "Error: image size must be specified before drawing operations\n");
-      } else if (scanf("%d %d %d %d %x", &rect.x, &rect.y, &rect.width, &rect.height, &color) != 5) {
-        error = 1;
-        fprintf(stderr, "Error: invalid rectangle\n");
-      } else {
-        draw_rect(&canvas, &rect, color);
-      }
+  struct Input input;
+  if (scene_filename != NULL) {
+    switch (read_scene_file(scene_filename, &scene)) {
+    case IMG_SUCCESS:
       break;
-
-    case 'C': // "Circle"
-      if (canvas.data == NULL) {
-        error = 1;
-        fprintf(stderr, "Error: image size must be specified before drawing operations\n");
-      } else if (scanf("%d %d %d %x", &x, &y, &r, &color) != 4) {
-        error = 1;
-        fprintf(stderr, "Error: invalid circle\n");
-      } else {
-        draw_circle(&canvas, x, y, r, color);
-      }
+    case IMG_ERR_COULD_NOT_OPEN:
+      error = 1;
+      fprintf(stderr, "Error: could not open scene file\n");
       break;
-
-    case 'L': // "Load"
-      if (scanf("%d", &n) != 1) {
-        error = 1;
-        fprintf(stderr, "Error: invalid image number\n");
-      } else {
-        skipws(stdin);
-        if (scanf("%255s", filename) != 1) {
-          error = 1;
-          fprintf(stderr, "Error: error reading image filename\n");
-        } else if (n < 0 || n >= NUM_IMAGE_SLOTS || loaded_images[n].data != NULL) {
-          error = 1;
-          fprintf(stderr, "Error: invalid image number\n");
-        } else if (read_image(filename, &loaded_images[n]) != IMG_SUCCESS) {
-          error = 1;
-          fprintf(stderr, "Error: could not read image\n");
-        }
-      }
+    case SCENE_ERR_BAD_IMAGE:
+      error = 1;
+      fprintf(stderr, "Error: could not read image\n");
       break;
-
-    case 'T': // "Tile"
-      if (scanf("%d %d %d %d %d %d %d", &n, &rect.x, &rect.y, &rect.width, &rect.height, &x, &y) != 7) {
-        error = 1;
-        fprintf(stderr, "Error: invalid T command\n");
-      } else if (n < 0 || n >= NUM_IMAGE_SLOTS || loaded_images[n].data == NULL) {
-        error = 1;
-        fprintf(stderr, "Error: invalid image number\n");
-      } else {
-        draw_tile(&canvas, x, y, &loaded_images[n], &rect);
-      }
+    case IMG_ERR_MALLOC_FAILED:
+      error = 1;
+      fprintf(stderr, "Error: could not create canvas\n");
       break;
+    default:
+      error = 1;
+      fprintf(stderr, "Error: invalid scene file\n");
+    }
+  } else if (read_input(STDIN_FILENO, &input) != IMG_SUCCESS) {
+    error = 1;
+    fprintf(stderr, "Error: could not read input\n");
+  } else {
+    // parse the whole script into the scene's command buffer; images
+    // are loaded as their L commands are read
+    error = parse_scene(input.data, input.size, &scene);
+    free_input(&input);
+  }
 
-    case 'P': // "sPrite"
-      if (scanf("%d %d %d %d %d %d %d", &n, &rect.x, &rect.y, &rect.width, &rect.height, &x, &y) != 7) {
-        error = 1;
-        fprintf(stderr, "Error: invalid P command\n");
-      } else if (n < 0 || n >= NUM_IMAGE_SLOTS || loaded_images[n].data == NULL) {
-        error = 1;
-        fprintf(stderr, "Error: invalid image number\n");
+  if (!error) {
+    // if there isn't enough memory to optimize, just render the
+    // commands as they are
+    optimize_scene(&scene);
+    // rendering can only fail while preparing the sprite atlases
+    if (render_scene_parallel(&scene, num_threads) != IMG_SUCCESS) {
+      error = 1;
+      if (scene.use_atlases) {
+        fprintf(stderr, "Error: could not create sprite atlas\n");
       } else {
-        draw_sprite(&canvas, x, y, &loaded_images[n], &rect);
+        fprintf(stderr, "Error: could not render scene\n");
       }
-      break;
-
-    default:
-      fprintf(stderr, "Error: unrecognized command\n");
-      error = 1;
     }
   }
 
   // try to write output file
-  if (!error && write_image(argv[1], &canvas) != IMG_SUCCESS) {
-    error = 1;
-    fprintf(stderr, "Error: could not write image\n");
+  if (!error) {
+    int rc;
+    if (raw_frame_format != 0) {
+      rc = write_raw_frame_file(output_filename, &scene.canvas, raw_frame_format);
+    } else {
+      rc = write_image(output_filename, &scene.canvas);
+    }
+    if (rc != IMG_SUCCESS) {
+      error = 1;
+      fprintf(stderr, "Error: could not write image\n");
+    }
   }
 
-  free(canvas.data);
-  for (int i = 0; i < NUM_IMAGE_SLOTS; i++) {
-    free(loaded_images[i].data);
-  }
+  free_scene(&scene);
 
   return (error != 0); // returns 0 IFF there was no error
 }
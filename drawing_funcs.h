@@ -46,6 +46,10 @@ void set_pixel(struct Image *img, uint32_t index, uint32_t color);
 
 int64_t square(int64_t x);
 int64_t square_dist(int64_t x1, int64_t y1, int64_t x2, int64_t y2);
+
+//returns the largest n such that n*n <= x
+//returns 0 if x is negative
+int64_t isqrt(int64_t x);
 //checks if a pixel is contained in a circle(inclusive) and if so
 //returns 1 = contained
 //returns 0 = outside the circle
@@ -63,6 +67,12 @@ int is_in_rect(struct Image* image, const struct Rect* rect, int32_t x, int32_t
 
 int rect_in_img(struct Image* image, const struct Rect* rect);
 
+//clips rect against the bounds of image and stores the covered
+//region in clipped
+//returns 1 if the clipped region contains at least one pixel
+//returns 0 if the rectangle is entirely outside the image
+int clip_rect(struct Image* image, const struct Rect* rect, struct Rect* clipped);
+
 
 void draw_pixel_no_blending(struct Image *img, int32_t x, int32_t y, uint32_t color);
 
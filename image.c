@@ -1,9 +1,46 @@
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "pnglite.h"
 #include "image.h"
+#include "image_formats.h"
 
-int png_init_called;
+// pnglite is set up once, even when images are read and written
+// by several threads
+static pthread_once_t png_init_once = PTHREAD_ONCE_INIT;
+
+static void init_pnglite(void) {
+  png_init(0, 0);
+}
+
+// zlib compression level used by write_image
+static int compression_level = PNG_DEFAULT_COMPRESSION;
+
+void set_image_compression_level(int level) {
+  compression_level = level;
+}
+
+// number of threads write_image compresses with
+static int num_threads = 1;
+
+void set_image_threads(int threads) {
+  num_threads = threads;
+}
+
+// whether write_image tries to write an indexed PNG
+static int use_palette = 0;
+
+void set_image_palette(int enable) {
+  use_palette = enable;
+}
 
 int is_little_endian(void) {
   int32_t x = 1;
@@ -36,116 +73,272 @@ int init_image(struct Image *img, uint32_t width, uint32_t height) {
   return IMG_SUCCESS;
 }
 
-int read_image(const char *filename, struct Image *img) {
-  if (!png_init_called) {
-    png_init(0, 0);
-    png_init_called = 1;
+// decode an opened png into img
+static int decode_png(png_t *png, struct Image *img) {
+  // only allow truecolor 8bpp images, and indexed ones (which
+  // png_get_rgba expands to truecolor)
+  if (!(png->color_type == PNG_TRUECOLOR && png->bpp == 3) &&
+      !(png->color_type == PNG_TRUECOLOR_ALPHA && png->bpp == 4) &&
+      png->color_type != PNG_INDEXED) {
+    return IMG_ERR_NOT_TRUECOLOR;
   }
 
-  png_t png;
+  size_t num_pixels = (size_t) png->width * png->height;
 
-  if (png_open_file_read(&png, filename) != PNG_NO_ERROR) {
-    return IMG_ERR_COULD_NOT_OPEN;
+  // png_get_rgba decodes straight into the RGBA format, adding the
+  // alpha channel to truecolor pixels and byteswapping as needed
+  uint32_t *pixel_data = (uint32_t *) malloc(num_pixels * sizeof(uint32_t));
+  if (pixel_data == NULL) {
+    return IMG_ERR_MALLOC_FAILED;
   }
 
-  // only allow truecolor 8bpp images
-  if (!(png.color_type == PNG_TRUECOLOR && png.bpp == 3) &&
-      !(png.color_type == PNG_TRUECOLOR_ALPHA && png.bpp == 4)) {
-    png_close_file(&png);
-    return IMG_ERR_NOT_TRUECOLOR;
+  if (png_get_rgba(png, (unsigned *) pixel_data) != PNG_NO_ERROR) {
+    free(pixel_data);
+    return IMG_ERR_MALLOC_FAILED;
   }
 
-  unsigned num_pixels = png.width * png.height;
+  // communicate pixel data and image dimensions to caller
+  img->data = pixel_data;
+  img->width = png->width;
+  img->height = png->height;
+  return IMG_SUCCESS;
+}
 
-  // allocate buffer for pixel data in truecolor RGBA format
-  uint32_t *pixel_data = (uint32_t *) malloc(num_pixels * sizeof(uint32_t));
+int read_image(const char *filename, struct Image *img) {
+  pthread_once(&png_init_once, init_pnglite);
 
-  if (png.color_type == PNG_TRUECOLOR) {
-    // PNG pixel data is in RGB form, expand it to add the alpha channel
+  png_t png;
 
-    unsigned char *pixel_data_raw = (unsigned char *) malloc(num_pixels * 3);
-    if (png_get_data(&png, pixel_data_raw) != PNG_NO_ERROR) {
-      png_close_file(&png);
-      free(pixel_data);
-      return IMG_ERR_MALLOC_FAILED;
+  // map the file, so that the image data is decoded straight from
+  // the page cache; files that can't be mapped are read with stdio,
+  // and can only be PNGs
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    return IMG_ERR_COULD_NOT_OPEN;
+  }
+  struct stat st;
+  void *data = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+
+  int rc;
+  if (data != MAP_FAILED) {
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+    switch (image_format_for_data(data, st.st_size)) {
+    case IMAGE_FORMAT_QOI:
+      rc = decode_qoi(data, st.st_size, img);
+      break;
+    case IMAGE_FORMAT_RAW:
+      rc = decode_raw_image(data, st.st_size, img);
+      break;
+    default:
+      if (png_open_mem_read(&png, data, st.st_size) != PNG_NO_ERROR) {
+        rc = IMG_ERR_COULD_NOT_OPEN;
+      } else {
+        rc = decode_png(&png, img);
+      }
     }
+    munmap(data, st.st_size);
+  } else {
+    if (png_open_file_read(&png, filename) != PNG_NO_ERROR) {
+      return IMG_ERR_COULD_NOT_OPEN;
+    }
+    rc = decode_png(&png, img);
+    png_close_file(&png);
+  }
 
-    for (unsigned i = 0; i < num_pixels; i++) {
-      unsigned char r = pixel_data_raw[i*3 + 0];
-      unsigned char g = pixel_data_raw[i*3 + 1];
-      unsigned char b = pixel_data_raw[i*3 + 2];
-      unsigned char a = 255;
+  return rc;
+}
 
-      pixel_data[i] = (r << 24) | (g << 16) | (b << 8) | a;
+int image_is_opaque(const struct Image *img) {
+  const uint32_t *data = img->data;
+  size_t num_pixels = (size_t) img->width * img->height;
+  size_t i = 0;
+#ifdef __SSE2__
+  // AND the pixels together 16 at a time, so a translucent pixel
+  // clears some bit of the alpha byte
+  const __m128i alpha = _mm_set1_epi32(0xFF);
+  for (; i + 16 <= num_pixels; i += 16) {
+    __m128i all = _mm_and_si128(_mm_and_si128(_mm_loadu_si128((const __m128i *) (data + i)),
+                                              _mm_loadu_si128((const __m128i *) (data + i + 4))),
+                                _mm_and_si128(_mm_loadu_si128((const __m128i *) (data + i + 8)),
+                                              _mm_loadu_si128((const __m128i *) (data + i + 12))));
+    all = _mm_cmpeq_epi32(_mm_and_si128(all, alpha), alpha);
+    if (_mm_movemask_epi8(all) != 0xFFFF) {
+      return 0;
+    }
+  }
+#endif
+  for (; i < num_pixels; i++) {
+    if ((data[i] & 0xFF) != 0xFF) {
+      return 0;
     }
+  }
+  return 1;
+}
 
-    free(pixel_data_raw);
-  } else {
-    // PNG pixel data is already in the correct format,
-    // except that the RGBA data is in big-endian form, so we
-    // need to byteswap if on a little endian system
-    if (png_get_data(&png, (unsigned char *) pixel_data) != PNG_NO_ERROR) {
-      png_close_file(&png);
-      free(pixel_data);
-      return IMG_ERR_MALLOC_FAILED;
+// Open-addressing hash table from colors to palette indices, with
+// room for the 256 colors an indexed PNG can hold at under 50% load.
+#define PALETTE_TABLE_SIZE 512
+
+struct ColorTable {
+  uint32_t colors[PALETTE_TABLE_SIZE];
+  int16_t index[PALETTE_TABLE_SIZE];   // -1 for empty slots
+  unsigned num_colors;
+  uint32_t last_color;   // most recently looked up color, since
+  int last_index;        // flat-color images have long runs of it
+};
+
+static unsigned color_slot(const struct ColorTable *table, uint32_t color) {
+  unsigned slot = (color * 2654435761U) >> 23;
+  while (table->index[slot] >= 0 && table->colors[slot] != color) {
+    slot = (slot + 1) % PALETTE_TABLE_SIZE;
+  }
+  return slot;
+}
+
+// build a histogram of the image's colors; returns 0 if there are
+// more than 256 of them
+static int build_palette(const uint32_t *data, size_t num_pixels, struct ColorTable *table,
+                         unsigned *palette) {
+  memset(table->index, -1, sizeof(table->index));
+  table->num_colors = 0;
+  for (size_t i = 0; i < num_pixels; i++) {
+    if (i > 0 && data[i] == data[i - 1]) {
+      continue;
     }
+    unsigned slot = color_slot(table, data[i]);
+    if (table->index[slot] < 0) {
+      if (table->num_colors == 256) {
+        return 0;
+      }
+      table->colors[slot] = data[i];
+      table->index[slot] = 0;
+      table->num_colors++;
+    }
+  }
 
-    if (is_little_endian()) {
-      for (unsigned i = 0; i < num_pixels; i++) {
-        pixel_data[i] = byteswap(pixel_data[i]);
+  // translucent colors go first, so the tRNS chunk only needs to
+  // cover them
+  unsigned n = 0;
+  for (int opaque = 0; opaque <= 1; opaque++) {
+    for (unsigned slot = 0; slot < PALETTE_TABLE_SIZE; slot++) {
+      if (table->index[slot] >= 0 && ((table->colors[slot] & 0xFF) == 0xFF) == opaque) {
+        table->index[slot] = n;
+        palette[n++] = table->colors[slot];
       }
     }
   }
+  table->last_color = palette[0];
+  table->last_index = 0;
+  return 1;
+}
 
-  // communicate pixel data and image dimensions to caller
-  img->data = pixel_data;
-  img->width = png.width;
-  img->height = png.height;
+// the smallest bit depth that can index num_colors colors
+static int palette_depth(unsigned num_colors) {
+  int depth = 1;
+  while ((1U << depth) < num_colors) {
+    depth *= 2;
+  }
+  return depth;
+}
 
-  png_close_file(&png);
+// convert a row of pixels to palette indices, packing pixels smaller
+// than a byte with the leftmost one in the most significant bits
+static void pack_indexed_row(const uint32_t *src, uint32_t width, int depth,
+                             struct ColorTable *table, uint8_t *row) {
+  int pixels_per_byte = 8 / depth;
+  memset(row, 0, ((size_t) width * depth + 7) / 8);
+  for (uint32_t x = 0; x < width; x++) {
+    if (src[x] != table->last_color) {
+      table->last_color = src[x];
+      table->last_index = table->index[color_slot(table, src[x])];
+    }
+    int shift = 8 - depth * (x % pixels_per_byte + 1);
+    row[x / pixels_per_byte] |= table->last_index << shift;
+  }
+}
 
-  return IMG_SUCCESS;
+// convert a row of pixels to PNG byte order, dropping the alpha
+// channel if bpp is 3
+static void pack_row(const uint32_t *src, uint32_t width, int bpp, uint8_t *row) {
+  for (uint32_t x = 0; x < width; x++) {
+    uint32_t color = src[x];
+    row[0] = color >> 24;
+    row[1] = color >> 16;
+    row[2] = color >> 8;
+    if (bpp == 4) {
+      row[3] = color;
+    }
+    row += bpp;
+  }
 }
 
 int write_image(const char *filename, struct Image *img) {
-  if (!png_init_called) {
-    png_init(0, 0);
-    png_init_called = 1;
+  switch (image_format_for_filename(filename)) {
+  case IMAGE_FORMAT_QOI:
+    return write_qoi(filename, img);
+  case IMAGE_FORMAT_RAW:
+    return write_raw_image(filename, img);
   }
 
+  pthread_once(&png_init_once, init_pnglite);
+
   png_t png;
 
   if (png_open_file_write(&png, filename) != PNG_NO_ERROR) {
     return IMG_ERR_COULD_NOT_OPEN;
   }
+  png.compression_level = compression_level;
+  png.num_threads = num_threads;
+
+  // an image with few enough colors can be written as palette
+  // indices (if enabled); otherwise a fully opaque image (which
+  // every rendered canvas normally is) is written as RGB, so there's
+  // a quarter less data to compress
+  size_t num_pixels = (size_t) img->width * img->height;
+  struct ColorTable table;
+  int color_type, depth = 8, bpp;
+  if (use_palette && num_pixels > 0 && build_palette(img->data, num_pixels, &table, png.palette)) {
+    color_type = PNG_INDEXED;
+    png.palette_size = table.num_colors;
+    depth = palette_depth(table.num_colors);
+    bpp = 1;
+  } else if (image_is_opaque(img)) {
+    color_type = PNG_TRUECOLOR;
+    bpp = 3;
+  } else {
+    color_type = PNG_TRUECOLOR_ALPHA;
+    bpp = 4;
+  }
 
-  // if this is a little endian system, we need to byteswap
-  // every uint32_t so that it can be written in big-endian order
-  // (which is what PNG requires)
-
-  uint32_t *data_to_write = img->data;
-  int need_byteswap = is_little_endian();
-
-  if (need_byteswap) {
-    data_to_write = (uint32_t *) malloc(img->width * img->height * sizeof(uint32_t));
-    if (data_to_write == NULL) {
-      png_close_file(&png);
-      return IMG_ERR_MALLOC_FAILED;
-    }
+  // the image is compressed one row at a time, so only one row
+  // is ever held in PNG (big-endian) form
+  uint8_t *row = (uint8_t *) malloc(((size_t) img->width + 1) * bpp);
+  if (row == NULL) {
+    png_close_file(&png);
+    return IMG_ERR_MALLOC_FAILED;
+  }
 
-    uint32_t num_pixels = img->width * img->height;
-    for (uint32_t i = 0; i < num_pixels; i++) {
-      data_to_write[i] = byteswap(img->data[i]);
+  int rc = png_write_begin(&png, img->width, img->height, depth, color_type);
+  for (uint32_t y = 0; y < img->height && rc == PNG_NO_ERROR; y++) {
+    const uint32_t *src = img->data + (size_t) y * img->width;
+    if (color_type == PNG_INDEXED) {
+      pack_indexed_row(src, img->width, depth, &table, row);
+    } else {
+      pack_row(src, img->width, bpp, row);
     }
+    rc = png_write_row(&png, row);
+  }
+  if (png_write_end(&png) != PNG_NO_ERROR) {
+    rc = PNG_IO_ERROR;
   }
-
-  int rc = png_set_data(&png, img->width, img->height, 8, PNG_TRUECOLOR_ALPHA, (unsigned char *) data_to_write);
   int success = (rc == PNG_NO_ERROR);
 
+  free(row);
   png_close_file(&png);
-  if (need_byteswap) {
-    free(data_to_write);
-  }
 
   return success ? IMG_SUCCESS : IMG_ERR_COULD_NOT_WRITE;
 }
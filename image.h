@@ -34,7 +34,8 @@ struct Image {
 int init_image(struct Image *img, uint32_t width, uint32_t height);
 
 // Read PNG image data from a file and initialize the specified
-// Image struct instance.
+// Image struct instance. QOI and raw image files (see
+// image_formats.h) are recognized and read too.
 //
 // Parameters:
 //   filename - name of PNG file to read
@@ -47,7 +48,8 @@ int init_image(struct Image *img, uint32_t width, uint32_t height);
 int read_image(const char *filename, struct Image *img);
 
 // Write pixel data from specified Image struct instance to the
-// named PNG output file.
+// named PNG output file. A filename ending in .qoi or .rgba gets a
+// QOI or raw image file instead (see image_formats.h).
 //
 // Parameters:
 //   filename - name of PNG file to write
@@ -59,4 +61,36 @@ int read_image(const char *filename, struct Image *img);
 //   IMG_ERR_* values
 int write_image(const char *filename, struct Image *img);
 
+// Check whether every pixel of an image has an alpha of 255.
+//
+// Parameters:
+//   img - pointer to Image struct
+//
+// Returns:
+//   1 if the image is fully opaque, 0 if not
+int image_is_opaque(const struct Image *img);
+
+// Set the zlib compression level used by write_image.
+//
+// Parameters:
+//   level - 0 (no compression or filtering) to 9 (smallest output),
+//           or -1 for zlib's default
+void set_image_compression_level(int level);
+
+// Set the number of threads write_image compresses with. Big images
+// are split into strips that are compressed in parallel (see
+// png_write_begin in pnglite.h).
+//
+// Parameters:
+//   threads - number of threads (1 to compress on the calling thread)
+void set_image_threads(int threads);
+
+// Make write_image write an indexed (palette) PNG, at the smallest
+// bit depth that fits, when an image has at most 256 colors. Images
+// with more colors are written as before.
+//
+// Parameters:
+//   enable - 1 to write indexed PNGs where possible, 0 not to
+void set_image_palette(int enable);
+
 #endif
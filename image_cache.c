@@ -0,0 +1,167 @@
+// Cache of decoded images, stored as mappable raw pixel files
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "image_cache.h"
+
+#define BYTE_ORDER_MARK 0x01020304U
+
+static const char cache_magic[4] = { 'C', 'S', 'F', 'I' };
+
+struct CacheHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t width;
+  uint32_t height;
+  uint32_t data_offset;
+  int64_t source_size;
+  int64_t source_mtime_sec;
+  int64_t source_mtime_nsec;
+  uint32_t path_len;
+  uint32_t reserved[3];
+};
+
+_Static_assert(sizeof(struct CacheHeader) == IMAGE_CACHE_HEADER_SIZE, "struct CacheHeader size");
+
+// FNV-1a, to turn a path into a cache file name
+static uint64_t hash_path(const char *path) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (const char *p = path; *p != '\0'; p++) {
+    hash ^= (uint8_t) *p;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+static void fill_header(struct CacheHeader *header, const char *path, const struct stat *st,
+                        uint32_t width, uint32_t height) {
+  memset(header, 0, sizeof(*header));
+  memcpy(header->magic, cache_magic, 4);
+  header->version = IMAGE_CACHE_VERSION;
+  header->byte_order = BYTE_ORDER_MARK;
+  header->width = width;
+  header->height = height;
+  header->path_len = strlen(path);
+  header->data_offset = (IMAGE_CACHE_HEADER_SIZE + header->path_len + 63) / 64 * 64;
+  header->source_size = st->st_size;
+  header->source_mtime_sec = st->st_mtim.tv_sec;
+  header->source_mtime_nsec = st->st_mtim.tv_nsec;
+}
+
+// check that a mapped cache file is complete and belongs to the
+// current version of the PNG at path
+static int cache_file_matches(const uint8_t *data, size_t size, const char *path,
+                              const struct stat *st) {
+  struct CacheHeader header, expected;
+  if (size < sizeof(header)) {
+    return 0;
+  }
+  memcpy(&header, data, sizeof(header));
+  fill_header(&expected, path, st, header.width, header.height);
+  if (memcmp(&header, &expected, sizeof(header)) != 0
+      || size != header.data_offset + (uint64_t) header.width * header.height * sizeof(uint32_t)) {
+    return 0;
+  }
+  return memcmp(data + sizeof(header), path, header.path_len) == 0;
+}
+
+static int write_fully(int fd, const void *buf, size_t size) {
+  const char *p = buf;
+  while (size > 0) {
+    ssize_t n = write(fd, p, size);
+    if (n <= 0) {
+      return 0;
+    }
+    p += n;
+    size -= n;
+  }
+  return 1;
+}
+
+// write the cache file under a temporary name and rename it into
+// place, so other processes never see a partial file
+static void write_cache_file(const char *cache_filename, const char *path, const struct stat *st,
+                             const struct Image *img) {
+  char tmp_filename[PATH_MAX];
+  if (snprintf(tmp_filename, sizeof(tmp_filename), "%s.XXXXXX", cache_filename)
+      >= (int) sizeof(tmp_filename)) {
+    return;
+  }
+  int fd = mkstemp(tmp_filename);
+  if (fd < 0) {
+    return;
+  }
+
+  struct CacheHeader header;
+  fill_header(&header, path, st, img->width, img->height);
+  char padding[64] = { 0 };
+  int ok = write_fully(fd, &header, sizeof(header))
+           && write_fully(fd, path, header.path_len)
+           && write_fully(fd, padding, header.data_offset - sizeof(header) - header.path_len)
+           && write_fully(fd, img->data, (size_t) img->width * img->height * sizeof(uint32_t));
+  ok = (close(fd) == 0) && ok;
+
+  if (!ok || rename(tmp_filename, cache_filename) != 0) {
+    unlink(tmp_filename);
+  }
+}
+
+int read_image_cached(const char *cache_dir, const char *filename, struct Image *img,
+                      void **mapping, size_t *mapping_size) {
+  *mapping = NULL;
+  *mapping_size = 0;
+
+  char path[PATH_MAX];
+  char cache_filename[PATH_MAX];
+  struct stat st;
+  if (realpath(filename, path) == NULL || stat(path, &st) != 0
+      || snprintf(cache_filename, sizeof(cache_filename), "%s/%016llx.rgba", cache_dir,
+                  (unsigned long long) hash_path(path)) >= (int) sizeof(cache_filename)) {
+    // let read_image report the problem
+    return read_image(filename, img);
+  }
+
+  int fd = open(cache_filename, O_RDONLY);
+  if (fd >= 0) {
+    struct stat cache_st;
+    void *data = MAP_FAILED;
+    if (fstat(fd, &cache_st) == 0 && cache_st.st_size >= IMAGE_CACHE_HEADER_SIZE) {
+      // private and writable like a decoded image, but changes never
+      // reach the cache file
+      data = mmap(NULL, cache_st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (data != MAP_FAILED) {
+      if (cache_file_matches(data, cache_st.st_size, path, &st)) {
+        struct CacheHeader header;
+        memcpy(&header, data, sizeof(header));
+        img->width = header.width;
+        img->height = header.height;
+        img->data = (uint32_t *) ((uint8_t *) data + header.data_offset);
+        *mapping = data;
+        *mapping_size = cache_st.st_size;
+        return IMG_SUCCESS;
+      }
+      munmap(data, cache_st.st_size);
+    }
+  }
+
+  int rc = read_image(filename, img);
+
+  // don't cache the image if the PNG changed while it was read
+  struct stat after;
+  if (rc == IMG_SUCCESS && stat(path, &after) == 0 && after.st_size == st.st_size
+      && after.st_mtim.tv_sec == st.st_mtim.tv_sec && after.st_mtim.tv_nsec == st.st_mtim.tv_nsec) {
+    mkdir(cache_dir, 0777);
+    write_cache_file(cache_filename, path, &st, img);
+  }
+  return rc;
+}
@@ -0,0 +1,54 @@
+#ifndef IMAGE_CACHE_H
+#define IMAGE_CACHE_H
+
+#include <stddef.h>
+#include "image.h"
+
+// The image cache keeps decoded images in a directory as raw pixel
+// files that can be mapped and used directly, so that loading the
+// same PNG again skips decoding it. A cache file is named after a
+// hash of the PNG's absolute path, and is only used while the PNG's
+// size and modification time match the ones recorded in it.
+//
+// Cache files are only meant for the machine that wrote them: all
+// values, including the pixels, are in the host's byte order.
+//
+//   offset  size  contents
+//   0       4     magic "CSFI"
+//   4       4     format version (IMAGE_CACHE_VERSION)
+//   8       4     0x01020304, to reject files from other byte orders
+//   12      4     image width
+//   16      4     image height
+//   20      4     offset of the pixels (a multiple of 64)
+//   24      8     PNG size in bytes
+//   32      8     PNG modification time, seconds
+//   40      8     PNG modification time, nanoseconds
+//   48      4     length of the PNG's path
+//   52      12    reserved (0)
+//   64            the PNG's absolute path (not NUL-terminated)
+//   ...           width*height pixels, 0xRRGGBBAA
+#define IMAGE_CACHE_VERSION      1
+#define IMAGE_CACHE_HEADER_SIZE  64
+
+// Load a PNG through the cache in cache_dir (which is created if it
+// doesn't exist). On a hit, img->data points into a private mapping
+// of the cache file, which is returned in *mapping and must be
+// released with munmap(*mapping, *mapping_size) rather than free.
+// On a miss, the PNG is read with read_image, *mapping is set to
+// NULL, and a cache file is written for next time. Failing to write
+// the cache file is not an error.
+//
+// Parameters:
+//   cache_dir    - directory holding the cache files
+//   filename     - name of the PNG file to load
+//   img          - pointer to Image struct to fill in
+//   mapping      - set to the mapping img->data points into, or NULL
+//   mapping_size - set to the size of the mapping
+//
+// Returns:
+//   IMG_SUCCESS if successful, otherwise one of the
+//   IMG_ERR_* values
+int read_image_cached(const char *cache_dir, const char *filename, struct Image *img,
+                      void **mapping, size_t *mapping_size);
+
+#endif // IMAGE_CACHE_H
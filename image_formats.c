@@ -0,0 +1,449 @@
+// QOI and raw image files, and raw frames (see image_formats.h)
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "image_formats.h"
+
+#define QOI_HEADER_SIZE  14
+#define QOI_MAX_PIXELS   400000000U   // the limit the reference decoder uses
+
+#define QOI_OP_INDEX  0x00   // 00xxxxxx
+#define QOI_OP_DIFF   0x40   // 01xxxxxx
+#define QOI_OP_LUMA   0x80   // 10xxxxxx
+#define QOI_OP_RUN    0xC0   // 11xxxxxx
+#define QOI_OP_RGB    0xFE
+#define QOI_OP_RGBA   0xFF
+#define QOI_MASK_2    0xC0
+
+static const uint8_t qoi_magic[4] = { 'q', 'o', 'i', 'f' };
+static const uint8_t qoi_end[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+static const uint8_t raw_magic[4] = { 'C', 'S', 'F', 'R' };
+
+// size of the buffer files are written through
+#define WRITE_BUF_SIZE 65536
+
+static uint32_t get_be32(const uint8_t *p) {
+  return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+static void put_be32(uint8_t *p, uint32_t val) {
+  p[0] = val >> 24;
+  p[1] = val >> 16;
+  p[2] = val >> 8;
+  p[3] = val;
+}
+
+static uint32_t get_le32(const uint8_t *p) {
+  return ((uint32_t) p[3] << 24) | ((uint32_t) p[2] << 16) | ((uint32_t) p[1] << 8) | p[0];
+}
+
+static void put_le32(uint8_t *p, uint32_t val) {
+  p[0] = val;
+  p[1] = val >> 8;
+  p[2] = val >> 16;
+  p[3] = val >> 24;
+}
+
+// position in the QOI index of a 0xRRGGBBAA color
+static unsigned qoi_hash(uint32_t color) {
+  return ((color >> 24) * 3 + ((color >> 16) & 0xFF) * 5 + ((color >> 8) & 0xFF) * 7
+          + (color & 0xFF) * 11) % 64;
+}
+
+int image_format_for_filename(const char *filename) {
+  const char *ext = strrchr(filename, '.');
+  if (ext != NULL && strchr(ext, '/') == NULL) {
+    if (strcasecmp(ext, ".qoi") == 0) {
+      return IMAGE_FORMAT_QOI;
+    }
+    if (strcasecmp(ext, ".rgba") == 0) {
+      return IMAGE_FORMAT_RAW;
+    }
+  }
+  return IMAGE_FORMAT_PNG;
+}
+
+int image_format_for_data(const void *data, size_t size) {
+  if (size >= QOI_HEADER_SIZE && memcmp(data, qoi_magic, 4) == 0) {
+    return IMAGE_FORMAT_QOI;
+  }
+  if (size >= RAW_IMAGE_HEADER_SIZE && memcmp(data, raw_magic, 4) == 0) {
+    return IMAGE_FORMAT_RAW;
+  }
+  return IMAGE_FORMAT_PNG;
+}
+
+int decode_qoi(const void *data, size_t size, struct Image *img) {
+  const uint8_t *p = data;
+  const uint8_t *end = p + size;
+  if (image_format_for_data(data, size) != IMAGE_FORMAT_QOI) {
+    return IMG_ERR_COULD_NOT_OPEN;
+  }
+  uint32_t width = get_be32(p + 4);
+  uint32_t height = get_be32(p + 8);
+  uint8_t channels = p[12];
+  if (width == 0 || height == 0 || (channels != 3 && channels != 4) || p[13] > 1
+      || height > QOI_MAX_PIXELS / width) {
+    return IMG_ERR_COULD_NOT_OPEN;
+  }
+  size_t num_pixels = (size_t) width * height;
+  uint32_t *pixels = (uint32_t *) malloc(num_pixels * sizeof(uint32_t));
+  if (pixels == NULL) {
+    return IMG_ERR_MALLOC_FAILED;
+  }
+
+  // the end marker doesn't hold pixels
+  p += QOI_HEADER_SIZE;
+  end -= sizeof(qoi_end);
+
+  uint32_t index[64] = { 0 };
+  uint32_t color = 0x000000FFU;
+  size_t i = 0;
+  while (i < num_pixels && p < end) {
+    uint8_t op = *p++;
+    if (op == QOI_OP_RGB) {
+      if (end - p < 3) {
+        break;
+      }
+      color = (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | (color & 0xFF);
+      p += 3;
+    } else if (op == QOI_OP_RGBA) {
+      if (end - p < 4) {
+        break;
+      }
+      color = get_be32(p);
+      p += 4;
+    } else if ((op & QOI_MASK_2) == QOI_OP_INDEX) {
+      color = index[op];
+    } else if ((op & QOI_MASK_2) == QOI_OP_DIFF) {
+      uint32_t r = (color >> 24) + ((op >> 4) & 3) - 2;
+      uint32_t g = (color >> 16) + ((op >> 2) & 3) - 2;
+      uint32_t b = (color >> 8) + (op & 3) - 2;
+      color = (r & 0xFF) << 24 | (g & 0xFF) << 16 | (b & 0xFF) << 8 | (color & 0xFF);
+    } else if ((op & QOI_MASK_2) == QOI_OP_LUMA) {
+      if (end - p < 1) {
+        break;
+      }
+      int dg = (op & 0x3F) - 32;
+      int dr_dg = (*p >> 4) - 8;
+      int db_dg = (*p & 0x0F) - 8;
+      p++;
+      uint32_t r = (color >> 24) + dg + dr_dg;
+      uint32_t g = (color >> 16) + dg;
+      uint32_t b = (color >> 8) + dg + db_dg;
+      color = (r & 0xFF) << 24 | (g & 0xFF) << 16 | (b & 0xFF) << 8 | (color & 0xFF);
+    } else {
+      // a run repeats the previous pixel 1 to 62 times
+      size_t run = (op & 0x3F) + 1;
+      if (run > num_pixels - i) {
+        run = num_pixels - i;
+      }
+      for (size_t j = 1; j < run; j++) {
+        pixels[i++] = color;
+      }
+    }
+    // every pixel goes into the index, as in the reference decoder
+    index[qoi_hash(color)] = color;
+    pixels[i++] = color;
+  }
+
+  if (i < num_pixels) {
+    free(pixels);
+    return IMG_ERR_COULD_NOT_OPEN;
+  }
+  img->width = width;
+  img->height = height;
+  img->data = pixels;
+  return IMG_SUCCESS;
+}
+
+// a FILE written through a big buffer of its own, so encoders can
+// put out bytes one at a time
+struct Writer {
+  FILE *fp;
+  uint8_t buf[WRITE_BUF_SIZE];
+  size_t len;
+  int error;
+};
+
+static void flush_writer(struct Writer *w) {
+  if (w->len > 0 && fwrite(w->buf, 1, w->len, w->fp) != w->len) {
+    w->error = 1;
+  }
+  w->len = 0;
+}
+
+// make room for n (at most 16) more bytes in the buffer, and return
+// where they go
+static uint8_t *writer_reserve(struct Writer *w, size_t n) {
+  if (w->len + n > WRITE_BUF_SIZE) {
+    flush_writer(w);
+  }
+  uint8_t *p = w->buf + w->len;
+  w->len += n;
+  return p;
+}
+
+static struct Writer *open_writer(const char *filename) {
+  struct Writer *w = (struct Writer *) malloc(sizeof(struct Writer));
+  if (w == NULL) {
+    return NULL;
+  }
+  w->fp = fopen(filename, "wb");
+  if (w->fp == NULL) {
+    free(w);
+    return NULL;
+  }
+  w->len = 0;
+  w->error = 0;
+  return w;
+}
+
+// flush and close a writer; returns IMG_SUCCESS if everything was
+// written
+static int close_writer(struct Writer *w) {
+  flush_writer(w);
+  int error = w->error;
+  if (fclose(w->fp) != 0) {
+    error = 1;
+  }
+  free(w);
+  return error ? IMG_ERR_COULD_NOT_WRITE : IMG_SUCCESS;
+}
+
+int write_qoi(const char *filename, const struct Image *img) {
+  if (img->width == 0 || img->height == 0 || img->height > QOI_MAX_PIXELS / img->width) {
+    return IMG_ERR_COULD_NOT_WRITE;
+  }
+  struct Writer *w = open_writer(filename);
+  if (w == NULL) {
+    return IMG_ERR_COULD_NOT_OPEN;
+  }
+
+  uint8_t *header = writer_reserve(w, QOI_HEADER_SIZE);
+  memcpy(header, qoi_magic, 4);
+  put_be32(header + 4, img->width);
+  put_be32(header + 8, img->height);
+  header[12] = image_is_opaque(img) ? 3 : 4;
+  header[13] = 0;   // sRGB with linear alpha
+
+  uint32_t index[64] = { 0 };
+  uint32_t prev = 0x000000FFU;
+  unsigned run = 0;
+  size_t num_pixels = (size_t) img->width * img->height;
+  for (size_t i = 0; i < num_pixels; i++) {
+    uint32_t color = img->data[i];
+    if (color == prev) {
+      run++;
+      if (run == 62 || i == num_pixels - 1) {
+        *writer_reserve(w, 1) = QOI_OP_RUN | (run - 1);
+        run = 0;
+      }
+      continue;
+    }
+    if (run > 0) {
+      *writer_reserve(w, 1) = QOI_OP_RUN | (run - 1);
+      run = 0;
+    }
+
+    unsigned pos = qoi_hash(color);
+    if (index[pos] == color) {
+      *writer_reserve(w, 1) = QOI_OP_INDEX | pos;
+    } else {
+      index[pos] = color;
+      if ((color & 0xFF) == (prev & 0xFF)) {
+        // differences wrap around, like the decoder's sums
+        int8_t dr = (int8_t) ((color >> 24) - (prev >> 24));
+        int8_t dg = (int8_t) ((color >> 16) - (prev >> 16));
+        int8_t db = (int8_t) ((color >> 8) - (prev >> 8));
+        int8_t dr_dg = dr - dg;
+        int8_t db_dg = db - dg;
+        if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+          *writer_reserve(w, 1) = QOI_OP_DIFF | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2);
+        } else if (dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 && db_dg >= -8 && db_dg <= 7) {
+          uint8_t *p = writer_reserve(w, 2);
+          p[0] = QOI_OP_LUMA | (dg + 32);
+          p[1] = (dr_dg + 8) << 4 | (db_dg + 8);
+        } else {
+          uint8_t *p = writer_reserve(w, 4);
+          p[0] = QOI_OP_RGB;
+          p[1] = color >> 24;
+          p[2] = color >> 16;
+          p[3] = color >> 8;
+        }
+      } else {
+        uint8_t *p = writer_reserve(w, 5);
+        p[0] = QOI_OP_RGBA;
+        put_be32(p + 1, color);
+      }
+    }
+    prev = color;
+  }
+
+  memcpy(writer_reserve(w, sizeof(qoi_end)), qoi_end, sizeof(qoi_end));
+  return close_writer(w);
+}
+
+int decode_raw_image(const void *data, size_t size, struct Image *img) {
+  const uint8_t *p = data;
+  if (image_format_for_data(data, size) != IMAGE_FORMAT_RAW) {
+    return IMG_ERR_COULD_NOT_OPEN;
+  }
+  uint32_t width = get_le32(p + 4);
+  uint32_t height = get_le32(p + 8);
+  uint32_t data_offset = get_le32(p + 12);
+  uint64_t num_pixels = (uint64_t) width * height;
+  if (data_offset < RAW_IMAGE_HEADER_SIZE || data_offset % 4 != 0 || data_offset > size
+      || (size - data_offset) / 4 != num_pixels || (size - data_offset) % 4 != 0) {
+    return IMG_ERR_COULD_NOT_OPEN;
+  }
+
+  uint32_t *pixels = (uint32_t *) malloc(num_pixels * sizeof(uint32_t));
+  if (pixels == NULL) {
+    return IMG_ERR_MALLOC_FAILED;
+  }
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  memcpy(pixels, p + data_offset, num_pixels * sizeof(uint32_t));
+#else
+  for (size_t i = 0; i < num_pixels; i++) {
+    pixels[i] = get_le32(p + data_offset + i * 4);
+  }
+#endif
+
+  img->width = width;
+  img->height = height;
+  img->data = pixels;
+  return IMG_SUCCESS;
+}
+
+int write_raw_image(const char *filename, const struct Image *img) {
+  FILE *fp = fopen(filename, "wb");
+  if (fp == NULL) {
+    return IMG_ERR_COULD_NOT_OPEN;
+  }
+
+  uint8_t header[RAW_IMAGE_HEADER_SIZE];
+  memcpy(header, raw_magic, 4);
+  put_le32(header + 4, img->width);
+  put_le32(header + 8, img->height);
+  put_le32(header + 12, RAW_IMAGE_HEADER_SIZE);
+  int ok = fwrite(header, 1, sizeof(header), fp) == sizeof(header);
+
+  size_t num_pixels = (size_t) img->width * img->height;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  // the pixels are already in the file's layout
+  ok = ok && fwrite(img->data, sizeof(uint32_t), num_pixels, fp) == num_pixels;
+#else
+  for (size_t i = 0; i < num_pixels && ok; i++) {
+    uint8_t pixel[4];
+    put_le32(pixel, img->data[i]);
+    ok = fwrite(pixel, 1, 4, fp) == 4;
+  }
+#endif
+
+  ok = (fclose(fp) == 0) && ok;
+  return ok ? IMG_SUCCESS : IMG_ERR_COULD_NOT_WRITE;
+}
+
+int raw_frame_format_for_name(const char *name) {
+  if (strcmp(name, "rgba") == 0) {
+    return RAW_FRAME_RGBA;
+  } else if (strcmp(name, "rgb") == 0) {
+    return RAW_FRAME_RGB;
+  } else if (strcmp(name, "abgr") == 0) {
+    return RAW_FRAME_ABGR;
+  }
+  return 0;
+}
+
+// write all of buf, continuing after partial writes and signals;
+// returns 0 on success
+static int write_all(int fd, const void *buf, size_t len) {
+  const uint8_t *p = buf;
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return 1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+// convert pixels to a raw frame layout
+static size_t pack_frame_pixels(const uint32_t *src, size_t num_pixels, int format, uint8_t *dst) {
+  uint8_t *start = dst;
+  for (size_t i = 0; i < num_pixels; i++) {
+    uint32_t color = src[i];
+    if (format == RAW_FRAME_ABGR) {
+      put_le32(dst, color);
+      dst += 4;
+    } else {
+      dst[0] = color >> 24;
+      dst[1] = color >> 16;
+      dst[2] = color >> 8;
+      if (format == RAW_FRAME_RGBA) {
+        dst[3] = color;
+        dst += 4;
+      } else {
+        dst += 3;
+      }
+    }
+  }
+  return dst - start;
+}
+
+int write_raw_frame(int fd, const struct Image *img, int format) {
+  size_t num_pixels = (size_t) img->width * img->height;
+
+  // write straight from the canvas if it's already in the frame's
+  // layout
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  int native_format = RAW_FRAME_ABGR;
+#else
+  int native_format = RAW_FRAME_RGBA;
+#endif
+  if (format == native_format) {
+    return write_all(fd, img->data, num_pixels * sizeof(uint32_t)) == 0
+      ? IMG_SUCCESS : IMG_ERR_COULD_NOT_WRITE;
+  }
+
+  // otherwise convert it one buffer at a time
+  uint8_t *buf = (uint8_t *) malloc(WRITE_BUF_SIZE);
+  if (buf == NULL) {
+    return IMG_ERR_MALLOC_FAILED;
+  }
+  int error = 0;
+  const size_t chunk = WRITE_BUF_SIZE / 4;
+  for (size_t i = 0; i < num_pixels && !error; i += chunk) {
+    size_t n = num_pixels - i < chunk ? num_pixels - i : chunk;
+    error = write_all(fd, buf, pack_frame_pixels(img->data + i, n, format, buf));
+  }
+  free(buf);
+  return error ? IMG_ERR_COULD_NOT_WRITE : IMG_SUCCESS;
+}
+
+int write_raw_frame_file(const char *filename, const struct Image *img, int format) {
+  if (strcmp(filename, "-") == 0) {
+    return write_raw_frame(STDOUT_FILENO, img, format);
+  }
+  int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0) {
+    return IMG_ERR_COULD_NOT_OPEN;
+  }
+  int rc = write_raw_frame(fd, img, format);
+  if (close(fd) != 0 && rc == IMG_SUCCESS) {
+    rc = IMG_ERR_COULD_NOT_WRITE;
+  }
+  return rc;
+}
@@ -0,0 +1,149 @@
+#ifndef IMAGE_FORMATS_H
+#define IMAGE_FORMATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "image.h"
+
+// Image file formats other than PNG. read_image recognizes them by
+// their contents, and write_image picks one by the file extension:
+//
+//   .qoi   - QOI, the "Quite OK Image" format (https://qoiformat.org),
+//            which is lossless like PNG but much faster to encode
+//            and decode
+//   .rgba  - the raw container below, which needs no encoding at all
+//
+// Every other extension gets a PNG.
+//
+// The raw container is a 16-byte header followed by the pixels, with
+// every value little-endian:
+//
+//   offset  size  contents
+//   0       4     magic "CSFR"
+//   4       4     image width
+//   8       4     image height
+//   12      4     offset of the pixels (16; a multiple of 4)
+//   16            width*height pixels, 0xRRGGBBAA
+//
+// so on a little-endian machine the pixels can be mapped and used
+// as they are. (Other programs can read them as 8-bit ABGR.)
+#define IMAGE_FORMAT_PNG   0
+#define IMAGE_FORMAT_QOI   1
+#define IMAGE_FORMAT_RAW   2
+
+#define RAW_IMAGE_HEADER_SIZE  16
+
+// Layouts of raw frames: bare pixels with no header, one frame after
+// another, for piping into a video encoder (e.g. ffmpeg -f rawvideo
+// -pix_fmt rgba -s WxH -i -). The names give the order of the bytes
+// in the stream, as ffmpeg's pixel formats do. ABGR is how the
+// canvas is laid out in memory on a little-endian machine, so it is
+// written without converting (or copying) the pixels at all; RGB
+// drops the alpha channel.
+#define RAW_FRAME_RGBA  1
+#define RAW_FRAME_RGB   2
+#define RAW_FRAME_ABGR  3
+
+// Choose the format to write a file in from its extension.
+//
+// Parameters:
+//   filename - name of the file
+//
+// Returns:
+//   one of the IMAGE_FORMAT_* values
+int image_format_for_filename(const char *filename);
+
+// Recognize the format of an image file from its first bytes.
+//
+// Parameters:
+//   data - the file's contents
+//   size - size of data in bytes
+//
+// Returns:
+//   one of the IMAGE_FORMAT_* values (IMAGE_FORMAT_PNG for anything
+//   that isn't QOI or a raw image)
+int image_format_for_data(const void *data, size_t size);
+
+// Decode a QOI file that is in memory.
+//
+// Parameters:
+//   data - the file's contents
+//   size - size of data in bytes
+//   img  - pointer to Image struct to initialize
+//
+// Returns:
+//   IMG_SUCCESS if successful, otherwise one of the
+//   IMG_ERR_* values
+int decode_qoi(const void *data, size_t size, struct Image *img);
+
+// Write an image as a QOI file (with 3 channels if it's opaque).
+//
+// Parameters:
+//   filename - name of the file to write
+//   img      - pointer to Image struct with the pixels
+//
+// Returns:
+//   IMG_SUCCESS if successful, otherwise one of the
+//   IMG_ERR_* values
+int write_qoi(const char *filename, const struct Image *img);
+
+// Decode a raw image file that is in memory.
+//
+// Parameters:
+//   data - the file's contents
+//   size - size of data in bytes
+//   img  - pointer to Image struct to initialize
+//
+// Returns:
+//   IMG_SUCCESS if successful, otherwise one of the
+//   IMG_ERR_* values
+int decode_raw_image(const void *data, size_t size, struct Image *img);
+
+// Write an image as a raw image file.
+//
+// Parameters:
+//   filename - name of the file to write
+//   img      - pointer to Image struct with the pixels
+//
+// Returns:
+//   IMG_SUCCESS if successful, otherwise one of the
+//   IMG_ERR_* values
+int write_raw_image(const char *filename, const struct Image *img);
+
+// Look up a raw frame layout by its name ("rgba", "rgb" or "abgr").
+//
+// Parameters:
+//   name - name of the layout
+//
+// Returns:
+//   one of the RAW_FRAME_* values, or 0 if the name is unknown
+int raw_frame_format_for_name(const char *name);
+
+// Write an image to a file descriptor as a raw frame. Partial writes
+// (to pipes and sockets) are continued until the whole frame is
+// written.
+//
+// Parameters:
+//   fd     - file descriptor to write to
+//   img    - pointer to Image struct with the pixels
+//   format - one of the RAW_FRAME_* values
+//
+// Returns:
+//   IMG_SUCCESS if successful, otherwise one of the
+//   IMG_ERR_* values
+int write_raw_frame(int fd, const struct Image *img, int format);
+
+// Write an image as a raw frame to a file, which is created or
+// truncated, or to the standard output if filename is "-".
+//
+// Parameters:
+//   filename - name of the file to write, or "-"
+//   img      - pointer to Image struct with the pixels
+//   format   - one of the RAW_FRAME_* values
+//
+// Returns:
+//   IMG_SUCCESS if successful, otherwise one of the
+//   IMG_ERR_* values
+int write_raw_frame_file(const char *filename, const struct Image *img, int format);
+
+#endif // IMAGE_FORMATS_H
@@ -0,0 +1,263 @@
+// Parsing scene scripts into a Scene, without stdio: the input is
+// mapped or read in one go and tokenized in place
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "parser.h"
+
+int read_input(int fd, struct Input *input) {
+  struct stat st;
+  input->data = NULL;
+  input->size = 0;
+  input->mapped = 0;
+
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data != MAP_FAILED) {
+      madvise(data, st.st_size, MADV_SEQUENTIAL);
+      input->data = data;
+      input->size = st.st_size;
+      input->mapped = 1;
+      return IMG_SUCCESS;
+    }
+  }
+
+  // pipes and the like are read into a buffer that doubles as needed
+  size_t capacity = 0;
+  for (;;) {
+    if (input->size == capacity) {
+      capacity = capacity ? capacity * 2 : 65536;
+      char *data = realloc(input->data, capacity);
+      if (data == NULL) {
+        free_input(input);
+        return IMG_ERR_MALLOC_FAILED;
+      }
+      input->data = data;
+    }
+    ssize_t n = read(fd, input->data + input->size, capacity - input->size);
+    if (n == 0) {
+      return IMG_SUCCESS;
+    }
+    if (n < 0) {
+      free_input(input);
+      return IMG_ERR_COULD_NOT_OPEN;
+    }
+    input->size += n;
+  }
+}
+
+void free_input(struct Input *input) {
+  if (input->mapped) {
+    munmap(input->data, input->size);
+  } else {
+    free(input->data);
+  }
+  input->data = NULL;
+  input->size = 0;
+  input->mapped = 0;
+}
+
+// The token readers below accept the same input as the scanf
+// conversions they replace (" %c", "%d", "%u", "%x" and "%s"), and
+// return 1 if a value was read, 0 otherwise.
+struct Parser {
+  const char *pos;
+  const char *end;
+};
+
+static int is_space(char c) {
+  return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+static void skip_space(struct Parser *p) {
+  while (p->pos < p->end && is_space(*p->pos)) {
+    p->pos++;
+  }
+}
+
+static int parse_char(struct Parser *p, char *c) {
+  skip_space(p);
+  if (p->pos == p->end) {
+    return 0;
+  }
+  *c = *p->pos++;
+  return 1;
+}
+
+static int hex_digit(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+
+// an optionally signed integer in the given base (10 or 16); like
+// scanf, out of range values wrap around
+static int parse_number(struct Parser *p, uint32_t base, uint32_t *val) {
+  skip_space(p);
+  int negative = 0;
+  if (p->pos < p->end && (*p->pos == '-' || *p->pos == '+')) {
+    negative = *p->pos == '-';
+    p->pos++;
+  }
+  // a 0x prefix counts as the digit 0, even if no hex digits follow
+  int have_digits = 0;
+  if (base == 16 && p->end - p->pos >= 2 && p->pos[0] == '0'
+      && (p->pos[1] == 'x' || p->pos[1] == 'X')) {
+    p->pos += 2;
+    have_digits = 1;
+  }
+
+  uint32_t result = 0;
+  int digit;
+  while (p->pos < p->end && (digit = hex_digit(*p->pos)) >= 0 && (uint32_t) digit < base) {
+    result = result * base + digit;
+    p->pos++;
+    have_digits = 1;
+  }
+  if (!have_digits) {
+    return 0;
+  }
+  *val = negative ? -result : result;
+  return 1;
+}
+
+static int parse_int(struct Parser *p, int32_t *val) {
+  uint32_t u;
+  if (!parse_number(p, 10, &u)) {
+    return 0;
+  }
+  *val = (int32_t) u;
+  return 1;
+}
+
+static int parse_uint(struct Parser *p, uint32_t *val) {
+  return parse_number(p, 10, val);
+}
+
+static int parse_hex(struct Parser *p, uint32_t *val) {
+  return parse_number(p, 16, val);
+}
+
+// a whitespace-delimited word of at most size-1 characters
+static int parse_word(struct Parser *p, char *buf, size_t size) {
+  skip_space(p);
+  size_t len = 0;
+  while (p->pos < p->end && !is_space(*p->pos) && len < size - 1) {
+    buf[len++] = *p->pos++;
+  }
+  buf[len] = '\0';
+  return len > 0;
+}
+
+// the 7 integers of a T or P command
+static int parse_image_args(struct Parser *p, int32_t *n, struct Command *cmd) {
+  return parse_int(p, n)
+      && parse_int(p, &cmd->rect.x) && parse_int(p, &cmd->rect.y)
+      && parse_int(p, &cmd->rect.width) && parse_int(p, &cmd->rect.height)
+      && parse_int(p, &cmd->x) && parse_int(p, &cmd->y);
+}
+
+int parse_scene(const char *data, size_t size, struct Scene *scene) {
+  struct Parser p = { .pos = data, .end = data + size };
+  uint32_t width, height;
+  char cmd;
+  struct Command command;
+  int32_t n;
+  char filename[256];
+
+  int error = 0;
+
+  while (!error && parse_char(&p, &cmd)) {
+    memset(&command, 0, sizeof(command));
+    command.type = cmd;
+
+    switch (cmd) {
+    case 'S': // "Size", must be the first command
+      if (!parse_uint(&p, &width) || !parse_uint(&p, &height)) {
+        error = 1;
+        fprintf(stderr, "Error: invalid C command\n");
+        break;
+      }
+      if (set_scene_size(scene, width, height) != IMG_SUCCESS) {
+        error = 1;
+        fprintf(stderr, "Error: could not create canvas\n");
+      }
+      break;
+
+    case 'R': // "Rectangle"
+      if (!scene->has_canvas) {
+        error = 1;
+        fprintf(stderr, "Error: image size must be specified before drawing operations\n");
+      } else if (!parse_int(&p, &command.rect.x) || !parse_int(&p, &command.rect.y)
+                 || !parse_int(&p, &command.rect.width) || !parse_int(&p, &command.rect.height)
+                 || !parse_hex(&p, &command.color)) {
+        error = 1;
+        fprintf(stderr, "Error: invalid rectangle\n");
+      }
+      break;
+
+    case 'C': // "Circle"
+      if (!scene->has_canvas) {
+        error = 1;
+        fprintf(stderr, "Error: image size must be specified before drawing operations\n");
+      } else if (!parse_int(&p, &command.x) || !parse_int(&p, &command.y)
+                 || !parse_int(&p, &command.r) || !parse_hex(&p, &command.color)) {
+        error = 1;
+        fprintf(stderr, "Error: invalid circle\n");
+      }
+      break;
+
+    case 'L': // "Load"
+      if (!parse_int(&p, &n)) {
+        error = 1;
+        fprintf(stderr, "Error: invalid image number\n");
+      } else if (!parse_word(&p, filename, sizeof(filename))) {
+        error = 1;
+        fprintf(stderr, "Error: error reading image filename\n");
+      } else if (n < 0 || n >= NUM_IMAGE_SLOTS || scene->filenames[n][0] != '\0') {
+        error = 1;
+        fprintf(stderr, "Error: invalid image number\n");
+      } else if (!scene->parse_only && load_scene_image(scene, n, filename) != IMG_SUCCESS) {
+        error = 1;
+        fprintf(stderr, "Error: could not read image\n");
+      } else {
+        strcpy(scene->filenames[n], filename);
+      }
+      break;
+
+    case 'T': // "Tile"
+    case 'P': // "sPrite"
+      if (!parse_image_args(&p, &n, &command)) {
+        error = 1;
+        fprintf(stderr, "Error: invalid %c command\n", cmd);
+      } else if (n < 0 || n >= NUM_IMAGE_SLOTS || scene->filenames[n][0] == '\0') {
+        error = 1;
+        fprintf(stderr, "Error: invalid image number\n");
+      }
+      command.slot = n;
+      break;
+
+    default:
+      fprintf(stderr, "Error: unrecognized command\n");
+      error = 1;
+    }
+
+    if (!error && cmd != 'S' && cmd != 'L' && add_command(scene, &command) != IMG_SUCCESS) {
+      error = 1;
+      fprintf(stderr, "Error: out of memory\n");
+    }
+  }
+
+  return error;
+}
@@ -0,0 +1,45 @@
+#ifndef PARSER_H
+#define PARSER_H
+
+#include <stddef.h>
+#include "scene.h"
+
+// the contents of an input file, either mapped or read into memory
+struct Input {
+  char *data;
+  size_t size;
+  int mapped;   // data is an mmap of the file rather than malloc'd
+};
+
+// Read everything from a file descriptor. Regular files are mapped
+// rather than copied.
+//
+// Parameters:
+//   fd    - file descriptor to read from
+//   input - pointer to Input to fill in
+//
+// Returns:
+//   IMG_SUCCESS if successful, otherwise one of the
+//   IMG_ERR_* values
+int read_input(int fd, struct Input *input);
+
+// Release the memory holding an input file's contents.
+//
+// Parameters:
+//   input - pointer to Input to clean up
+void free_input(struct Input *input);
+
+// Parse a scene script, loading images as their L commands are
+// read (unless the scene is parse_only) and adding the drawing
+// commands to the scene. Errors are reported on stderr.
+//
+// Parameters:
+//   data  - the script text (doesn't need to be NUL-terminated)
+//   size  - length of the script in bytes
+//   scene - pointer to Scene (should be freshly initialized)
+//
+// Returns:
+//   0 if the whole script was parsed, 1 if there was an error
+int parse_scene(const char *data, size_t size, struct Scene *scene);
+
+#endif // PARSER_H
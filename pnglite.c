@@ -10,9 +10,14 @@
 #include "zlite.h"
 #endif
 
+#include <pthread.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "pnglite.h"
 
 static png_alloc_t png_alloc;
@@ -40,6 +45,24 @@ static size_t file_read(png_t* png, void* out, size_t size, size_t numel)
 	return result;
 }
 
+/* read callback for pngs opened with png_open_mem_read; user_pointer is the png itself */
+static unsigned png_mem_read(void* output, size_t size, size_t numel, void* user_pointer)
+{
+	png_t* png = user_pointer;
+	size_t left = png->mem_size - png->mem_pos;
+	size_t n = size * numel;
+
+	if(n > left)
+		n = left - left % size;
+
+	if(output)
+		memcpy(output, png->mem + png->mem_pos, n);
+
+	png->mem_pos += n;
+
+	return (unsigned)(n / size);
+}
+
 static size_t file_write(png_t* png, void* p, size_t size, size_t numel)
 {
 	size_t result;
@@ -120,29 +143,40 @@ int png_init(png_alloc_t pngalloc, png_free_t pngfree)
 	return PNG_NO_ERROR;
 }
 
-static int png_get_bpp(png_t* png)
+static int png_get_channels(png_t* png)
 {
-	int bpp;
-
 	switch(png->color_type)
 	{
 	case PNG_GREYSCALE:
-		bpp = 1; break;
+		return 1;
 	case PNG_TRUECOLOR:
-		bpp = 3; break;
+		return 3;
 	case PNG_INDEXED:
-		bpp = 1; break;
+		return 1;
 	case PNG_GREYSCALE_ALPHA:
-		bpp = 2; break;
+		return 2;
 	case PNG_TRUECOLOR_ALPHA:
-		bpp = 4; break;
+		return 4;
 	default:
 		return PNG_FILE_ERROR;
 	}
+}
+
+/* bytes per pixel, which the filters round up to 1 for depths below 8 */
+static int png_get_bpp(png_t* png)
+{
+	int channels = png_get_channels(png);
 
-	bpp *= png->depth/8;
+	if(channels < 0)
+		return channels;
+
+	return (channels * png->depth + 7) / 8;
+}
 
-	return bpp;
+/* bytes per row, where pixels smaller than a byte are packed together */
+static size_t png_get_row_len(png_t* png)
+{
+	return ((size_t)png->width * png_get_channels(png) * png->depth + 7) / 8;
 }
 
 static int png_read_ihdr(png_t* png)
@@ -157,10 +191,7 @@ static int png_read_ihdr(png_t* png)
 	file_read_ul(png, &length);
 
 	if(length != 13)
-	{
-		printf("%d\n", length);
 		return PNG_CRC_ERROR;
-	}
 
 	if(file_read(png, ihdr, 1, 13+4) != 13+4)
 		return PNG_EOF_ERROR;
@@ -184,10 +215,17 @@ static int png_read_ihdr(png_t* png)
 	png->filter_method = ihdr[15];
 	png->interlace_method = ihdr[16];
 
+	png->palette_size = 0;
+
 	if(png->color_type == PNG_INDEXED)
+	{
+		if(png->depth != 1 && png->depth != 2 && png->depth != 4 && png->depth != 8)
+			return PNG_NOT_SUPPORTED;
+	}
+	else if(png->depth != 8 && png->depth != 16)
 		return PNG_NOT_SUPPORTED;
 
-	if(png->depth != 8 && png->depth != 16)
+	if(png_get_channels(png) < 0)
 		return PNG_NOT_SUPPORTED;
 
 	if(png->interlace_method)
@@ -202,9 +240,9 @@ static int png_write_ihdr(png_t* png)
 	unsigned char *p = ihdr;
 	unsigned crc;
 
-	file_write(png, "\x89\x50\x4E\x47\x0D\x0A\x1A\x0A", 1, 8);
-
-	file_write_ul(png, 13);
+	if(file_write(png, "\x89\x50\x4E\x47\x0D\x0A\x1A\x0A", 1, 8) != 8 ||
+	   file_write_ul(png, 13) != PNG_NO_ERROR)
+		return PNG_IO_ERROR;
 
 	*p = 'I';			p++;
 	*p = 'H';			p++;
@@ -218,16 +256,60 @@ static int png_write_ihdr(png_t* png)
 	*p = 0;				p++;
 	*p = 0;				p++;
 
-	file_write(png, ihdr, 1, 13+4);
-
 	crc = crc32(0L, 0, 0);
 	crc = crc32(crc, ihdr, 13+4);
 
-	file_write_ul(png, crc);
+	if(file_write(png, ihdr, 1, 13+4) != 13+4 ||
+	   file_write_ul(png, crc) != PNG_NO_ERROR)
+		return PNG_IO_ERROR;
+
+	return PNG_NO_ERROR;
+}
+
+/* write a chunk whose type and data are in buf */
+static int png_write_chunk(png_t* png, unsigned char* buf, unsigned length)
+{
+	unsigned crc;
+
+	crc = crc32(0L, Z_NULL, 0);
+	crc = crc32(crc, buf, length + 4);
+
+	if(file_write_ul(png, length) != PNG_NO_ERROR ||
+	   file_write(png, buf, 1, length + 4) != length + 4 ||
+	   file_write_ul(png, crc) != PNG_NO_ERROR)
+		return PNG_IO_ERROR;
 
 	return PNG_NO_ERROR;
 }
 
+/* write the PLTE chunk, and a tRNS chunk covering the entries up to the last one that isn't opaque */
+static int png_write_palette(png_t* png)
+{
+	unsigned char buf[4 + 3*256];
+	unsigned i, num_alpha = 0;
+	int result;
+
+	memcpy(buf, "PLTE", 4);
+	for(i = 0; i < png->palette_size; i++)
+	{
+		buf[4 + 3*i] = png->palette[i] >> 24;
+		buf[4 + 3*i + 1] = png->palette[i] >> 16;
+		buf[4 + 3*i + 2] = png->palette[i] >> 8;
+		if((png->palette[i] & 0xFF) != 0xFF)
+			num_alpha = i + 1;
+	}
+
+	result = png_write_chunk(png, buf, 3 * png->palette_size);
+	if(result != PNG_NO_ERROR || num_alpha == 0)
+		return result;
+
+	memcpy(buf, "tRNS", 4);
+	for(i = 0; i < num_alpha; i++)
+		buf[4 + i] = png->palette[i] & 0xFF;
+
+	return png_write_chunk(png, buf, num_alpha);
+}
+
 void png_print_info(png_t* png)
 {
 	printf("PNG INFO:\n");
@@ -281,6 +363,10 @@ int png_open_write(png_t* png, png_write_callback_t write_fun, void* user_pointe
 	png->write_fun = write_fun;
 	png->read_fun = 0;
 	png->user_pointer = user_pointer;
+	png->compression_level = PNG_DEFAULT_COMPRESSION;
+	png->num_threads = 1;
+	png->parallel = NULL;
+	png->palette_size = 0;
 
 	if(!write_fun && !user_pointer)
 		return PNG_WRONG_ARGUMENTS;
@@ -303,6 +389,15 @@ int png_open_file_read(png_t *png, const char* filename)
 	return png_open_read(png, 0, fp);
 }
 
+int png_open_mem_read(png_t* png, const void* data, size_t size)
+{
+	png->mem = data;
+	png->mem_size = size;
+	png->mem_pos = 0;
+
+	return png_open_read(png, png_mem_read, png);
+}
+
 int png_open_file_write(png_t *png, const char* filename)
 {
 	FILE* fp = fopen(filename, "wb");
@@ -325,27 +420,6 @@ int png_close_file(png_t* png)
 	return PNG_NO_ERROR;
 }
 
-static int png_init_deflate(png_t* png, unsigned char* data, int datalen)
-{
-	z_stream *stream;
-	png->zs = png_alloc(sizeof(z_stream));
-
-	stream = png->zs;
-
-	if(!stream)
-		return PNG_MEMORY_ERROR;
-
-	memset(stream, 0, sizeof(z_stream));
-
-	if(deflateInit(stream, Z_DEFAULT_COMPRESSION) != Z_OK)
-		return PNG_ZLIB_ERROR;
-
-	stream->next_in = data;
-	stream->avail_in = datalen;
-
-	return PNG_NO_ERROR;
-}
-
 static int png_init_inflate(png_t* png)
 {
 #if USE_ZLIB
@@ -371,23 +445,6 @@ static int png_init_inflate(png_t* png)
 		return PNG_ZLIB_ERROR;
 #endif
 
-	stream->next_out = png->png_data;
-	stream->avail_out = png->png_datalen;
-
-	return PNG_NO_ERROR;
-}
-
-static int png_end_deflate(png_t* png)
-{
-	z_stream *stream = png->zs;
-
-	if(!stream)
-		return PNG_MEMORY_ERROR;
-
-	deflateEnd(stream);
-
-	png_free(png->zs);
-
 	return PNG_NO_ERROR;
 }
 
@@ -407,16 +464,16 @@ static int png_end_inflate(png_t* png)
 #else
 	if(z_inflateEnd(stream) != Z_OK)
 #endif
-	{
-		printf("ZLIB says: %s\n", stream->msg);
 		return PNG_ZLIB_ERROR;
-	}
 
 	png_free(png->zs);
 
 	return PNG_NO_ERROR;
 }
 
+static int png_decode_row(png_t* png);
+
+/* inflate the data of one IDAT, decoding each row as soon as all of it has been inflated */
 static int png_inflate(png_t* png, unsigned char* data, int len)
 {
 	int result;
@@ -432,125 +489,147 @@ static int png_inflate(png_t* png, unsigned char* data, int len)
 	stream->next_in = data;
 	stream->avail_in = len;
 
+	/* anything after the last row is ignored */
+	while(stream->avail_in != 0 && png->rows_read < png->height)
+	{
+		stream->next_out = png->png_data + png->row_fill;
+		stream->avail_out = png->png_datalen - png->row_fill;
+
 #if USE_ZLIB
-	result = inflate(stream, Z_SYNC_FLUSH);
+		result = inflate(stream, Z_SYNC_FLUSH);
 #else
-	result = z_inflate(stream);
+		result = z_inflate(stream);
 #endif
 
-	if(result != Z_STREAM_END && result != Z_OK)
-	{
-		printf("%s\n", stream->msg);
-		return PNG_ZLIB_ERROR;
-	}
+		if(result != Z_STREAM_END && result != Z_OK)
+			return PNG_ZLIB_ERROR;
 
-	if(stream->avail_in != 0)
-		return PNG_ZLIB_ERROR;
+		png->row_fill = png->png_datalen - stream->avail_out;
+
+		if(png->row_fill == png->png_datalen)
+		{
+			result = png_decode_row(png);
+			if(result != PNG_NO_ERROR)
+				return result;
+		}
+
+		if(result == Z_STREAM_END)
+			break;
+	}
 
 	return PNG_NO_ERROR;
 }
 
-static int png_deflate(png_t* png, char* outdata, int outlen, int *outwritten)
+static int png_read_idat(png_t* png, unsigned length)
 {
-	int result;
-
-	z_stream *stream = png->zs;
-
-	if(!stream)
-		return PNG_MEMORY_ERROR;
-
-	stream->next_out = (unsigned char*)outdata;
-	stream->avail_out = outlen;
-
-	result = deflate(stream, Z_SYNC_FLUSH);
-
-	*outwritten = outlen - stream->avail_out;
+	unsigned char *data;
+#if DO_CRC_CHECKS
+	unsigned orig_crc;
+	unsigned calc_crc;
+#endif
 
-	if(result != Z_STREAM_END && result != Z_OK)
+	if(png->read_fun == png_mem_read)
 	{
-		printf("%s\n", stream->msg);
-		return PNG_ZLIB_ERROR;
-	}
+		/* the data is already in memory, so zlib can read it in place */
+		if(png->mem_size - png->mem_pos < length)
+			return PNG_FILE_ERROR;
 
-	return result;
-}
+		data = (unsigned char*)png->mem + png->mem_pos;
+		png->mem_pos += length;
+	}
+	else
+	{
+		if(!png->readbuf || png->readbuflen < length)
+		{
+			if (png->readbuf)
+			{
+				png_free(png->readbuf);
+			}
+			png->readbuf = png_alloc(length);
+			png->readbuflen = length;
+		}
 
-static int png_write_idats(png_t* png, unsigned char* data)
-{
-	unsigned char *chunk;
-	unsigned long written;
-	unsigned long crc;
-	unsigned size = png->width * png->height * png->bpp + png->height;
-	unsigned chunk_size = compressBound(size);
+		if(!png->readbuf)
+		{
+			return PNG_MEMORY_ERROR;
+		}
 
-	(void)png_init_deflate;
-	(void)png_end_deflate;
-	(void)png_deflate;
+		if(file_read(png, png->readbuf, 1, length) != length)
+		{
+			return PNG_FILE_ERROR;
+		}
 
-	chunk = png_alloc(chunk_size + 4);
-	memcpy(chunk, "IDAT", 4);
+		data = png->readbuf;
+	}
 
-	written = chunk_size;
-	compress(chunk+4, &written, data, size);
+#if DO_CRC_CHECKS
+	calc_crc = crc32(0L, Z_NULL, 0);
+	calc_crc = crc32(calc_crc, (unsigned char*)"IDAT", 4);
+	calc_crc = crc32(calc_crc, data, length);
 
-	crc = crc32(0L, Z_NULL, 0);
-	crc = crc32(crc, chunk, written+4);
-	set_ul(chunk+written+4, crc);
-	file_write_ul(png, written);
-	file_write(png, chunk, 1, written+8);
-	png_free(chunk);
+	file_read_ul(png, &orig_crc);
 
-	file_write_ul(png, 0);
-	file_write(png, "IEND", 1, 4);
-	crc = crc32(0L, (const unsigned char *)"IEND", 4);
-	file_write_ul(png, crc);
+	if(orig_crc != calc_crc)
+	{
+		return PNG_CRC_ERROR;
+	}
+#else
+	file_read_ul(png);
+#endif
 
-	return PNG_NO_ERROR;
+	return png_inflate(png, data, length);
 }
 
-static int png_read_idat(png_t* png, unsigned length)
+/* read a PLTE chunk, or the tRNS chunk of an indexed png, into png->palette */
+static int png_read_palette(png_t* png, unsigned type, unsigned length)
 {
+	unsigned char buf[4 + 3*256];
+	unsigned i;
 #if DO_CRC_CHECKS
 	unsigned orig_crc;
 	unsigned calc_crc;
 #endif
 
-	if(!png->readbuf || png->readbuflen < length)
-	{
-		if (png->readbuf)
-		{
-			png_free(png->readbuf);
-		}
-		png->readbuf = png_alloc(length);
-		png->readbuflen = length;
-	}
-
-	if(!png->readbuf)
+	if(type == *(unsigned int*)"PLTE")
 	{
-		return PNG_MEMORY_ERROR;
+		if(length == 0 || length % 3 != 0 || length / 3 > (1U << png->depth))
+			return PNG_FILE_ERROR;
 	}
+	else if(png->palette_size == 0 || length > png->palette_size)
+		return PNG_FILE_ERROR;
 
-	if(file_read(png, png->readbuf, 1, length) != length)
-	{
+	memcpy(buf, &type, 4);
+	if(file_read(png, buf + 4, 1, length) != length)
 		return PNG_FILE_ERROR;
-	}
 
 #if DO_CRC_CHECKS
 	calc_crc = crc32(0L, Z_NULL, 0);
-	calc_crc = crc32(calc_crc, (unsigned char*)"IDAT", 4);
-	calc_crc = crc32(calc_crc, (unsigned char*)png->readbuf, length);
+	calc_crc = crc32(calc_crc, buf, length + 4);
 
 	file_read_ul(png, &orig_crc);
 
 	if(orig_crc != calc_crc)
-	{
 		return PNG_CRC_ERROR;
-	}
 #else
 	file_read_ul(png);
 #endif
 
-	return png_inflate(png, png->readbuf, length);
+	if(type == *(unsigned int*)"PLTE")
+	{
+		png->palette_size = length / 3;
+		for(i = 0; i < png->palette_size; i++)
+			png->palette[i] = ((unsigned)buf[4 + 3*i] << 24) | ((unsigned)buf[4 + 3*i + 1] << 16) |
+					  ((unsigned)buf[4 + 3*i + 2] << 8) | 0xFF;
+		for(; i < 256; i++)
+			png->palette[i] = 0xFF;
+	}
+	else
+	{
+		for(i = 0; i < length; i++)
+			png->palette[i] = (png->palette[i] & ~0xFFU) | buf[4 + i];
+	}
+
+	return PNG_NO_ERROR;
 }
 
 static int png_process_chunk(png_t* png)
@@ -568,11 +647,17 @@ static int png_process_chunk(png_t* png)
 	{
 		if(!png->png_data) /* first IDAT */
 		{
-			png->png_datalen = png->width * png->height * png->bpp + png->height;
+			/* the palette has to come before the image data */
+			if(png->color_type == PNG_INDEXED && png->palette_size == 0)
+				return PNG_FILE_ERROR;
+
+			png->png_datalen = png_get_row_len(png) + 1;
 			png->png_data = png_alloc(png->png_datalen);
+			if(png->out_rgba)
+				png->png_prev = png_alloc(png->png_datalen);
 		}
 
-		if(!png->png_data)
+		if(!png->png_data || (png->out_rgba && !png->png_prev))
 			return PNG_MEMORY_ERROR;
 
 		if(!png->zs)
@@ -584,8 +669,20 @@ static int png_process_chunk(png_t* png)
 
 		return png_read_idat(png, length);
 	}
+	else if(type == *(unsigned int*)"PLTE" && png->color_type == PNG_INDEXED && !png->png_data)
+	{
+		return png_read_palette(png, type, length);
+	}
+	else if(type == *(unsigned int*)"tRNS" && png->color_type == PNG_INDEXED && !png->png_data)
+	{
+		return png_read_palette(png, type, length);
+	}
 	else if(type == *(unsigned int*)"IEND")
 	{
+		/* the image data stopped before the last row */
+		if(png->rows_read < png->height)
+			return PNG_EOF_ERROR;
+
 		return PNG_DONE;
 	}
 	else
@@ -596,55 +693,174 @@ static int png_process_chunk(png_t* png)
 	return result;
 }
 
-static void png_filter_sub(int stride, unsigned char* in, unsigned char* out, int len)
+/*
+	Unfiltering. Each filter function reconstructs one row; prev_line is the reconstructed row above it, which
+	must not be NULL (png_unfilter_row deals with the first row). The first pixel of a row, which has no
+	pixel to its left, is handled before the main loop rather than tested for on every byte.
+*/
+#ifdef __SSE2__
+/* the paeth predictor for 8 pixels' bytes in 16-bit lanes */
+static __m128i png_paeth_sse2(__m128i a, __m128i b, __m128i c)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i pa = _mm_sub_epi16(b, c);	/* p - a */
+	__m128i pb = _mm_sub_epi16(a, c);	/* p - b */
+	__m128i pc = _mm_add_epi16(pa, pb);	/* p - c */
+	__m128i use_a, use_b;
+
+	pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+	pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+	pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+
+	/* a if pa <= pb && pa <= pc, otherwise b if pb <= pc, otherwise c */
+	use_a = _mm_andnot_si128(_mm_or_si128(_mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc)),
+				 _mm_set1_epi16(-1));
+	use_b = _mm_andnot_si128(use_a, _mm_andnot_si128(_mm_cmpgt_epi16(pb, pc), _mm_set1_epi16(-1)));
+
+	return _mm_or_si128(_mm_and_si128(use_a, a),
+			    _mm_or_si128(_mm_and_si128(use_b, b),
+					 _mm_andnot_si128(_mm_or_si128(use_a, use_b), c)));
+}
+
+/*
+	Sub, average and paeth depend on the pixel to the left, so for 3 and 4 byte pixels these work one pixel at
+	a time in the low lanes of a register. The "left" pixel starts out as zero, which takes care of the first
+	pixel. Only the pixel's own bytes are ever loaded or stored.
+*/
+static __m128i png_load_pixel(const unsigned char* p, int bpp)
+{
+	int v = 0;
+
+	memcpy(&v, p, bpp);
+	return _mm_cvtsi32_si128(v);
+}
+
+static void png_store_pixel(unsigned char* p, __m128i x, int bpp)
+{
+	int v = _mm_cvtsi128_si32(x);
+
+	memcpy(p, &v, bpp);
+}
+
+static void png_filter_sub_sse2(int bpp, const unsigned char* in, unsigned char* out, size_t len)
 {
-	int i;
-	unsigned char a = 0;
+	__m128i d = _mm_setzero_si128();
+	size_t i;
 
-	for(i = 0; i < len; i++)
+	for(i = 0; i < len; i += bpp)
 	{
-		if(i >= stride)
-			a = out[i - stride];
+		d = _mm_add_epi8(png_load_pixel(in + i, bpp), d);
+		png_store_pixel(out + i, d, bpp);
+	}
+}
+
+static void png_filter_average_sse2(int bpp, const unsigned char* in, unsigned char* out,
+				    const unsigned char* prev_line, size_t len)
+{
+	__m128i a, b, avg;
+	__m128i d = _mm_setzero_si128();
+	size_t i;
 
-		out[i] = in[i] + a;
+	for(i = 0; i < len; i += bpp)
+	{
+		a = d;
+		b = png_load_pixel(prev_line + i, bpp);
+		/* avg_epu8 rounds up, so take off the low bit that rounding added */
+		avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
+		d = _mm_add_epi8(png_load_pixel(in + i, bpp), avg);
+		png_store_pixel(out + i, d, bpp);
 	}
 }
 
-static void png_filter_up(int stride, unsigned char* in, unsigned char* out, unsigned char* prev_line, int len)
+static void png_filter_paeth_sse2(int bpp, const unsigned char* in, unsigned char* out,
+				  const unsigned char* prev_line, size_t len)
 {
-	(void) stride;
+	__m128i zero = _mm_setzero_si128();
+	__m128i a, c;
+	__m128i b = zero;
+	__m128i d = zero;
+	size_t i;
+
+	/* a, b and c are kept as 16-bit lanes for png_paeth_sse2 */
+	for(i = 0; i < len; i += bpp)
+	{
+		a = d;
+		c = b;
+		b = _mm_unpacklo_epi8(png_load_pixel(prev_line + i, bpp), zero);
+		d = _mm_unpacklo_epi8(png_load_pixel(in + i, bpp), zero);
+		d = _mm_and_si128(_mm_add_epi16(d, png_paeth_sse2(a, b, c)), _mm_set1_epi16(0xFF));
+		png_store_pixel(out + i, _mm_packus_epi16(d, d), bpp);
+	}
+}
+#endif
 
-	int i;
+static void png_filter_sub(int stride, const unsigned char* in, unsigned char* out, size_t len)
+{
+	size_t i;
 
-	if(prev_line)
+#ifdef __SSE2__
+	if(stride == 3 || stride == 4)
 	{
-        for(i = 0; i < len; i++)
-		out[i] = in[i] + prev_line[i];
+		png_filter_sub_sse2(stride, in, out, len);
+		return;
 	}
-	else
-		memcpy(out, in, len);
+#endif
+
+	for(i = 0; i < (size_t)stride && i < len; i++)
+		out[i] = in[i];
+
+	for(; i < len; i++)
+		out[i] = in[i] + out[i - stride];
 }
 
-static void png_filter_average(int stride, unsigned char* in, unsigned char* out, unsigned char* prev_line, int len)
+static void png_filter_up(const unsigned char* in, unsigned char* out, const unsigned char* prev_line, size_t len)
 {
-	int i;
-	unsigned char a = 0;
-	unsigned char b = 0;
-	unsigned int sum = 0;
+	size_t i = 0;
 
-	for(i = 0; i < len; i++)
+#ifdef __SSE2__
+	for(; i + 16 <= len; i += 16)
 	{
-		if(prev_line)
-			b = prev_line[i];
+		__m128i x = _mm_loadu_si128((const __m128i*)(in + i));
+		__m128i b = _mm_loadu_si128((const __m128i*)(prev_line + i));
+
+		_mm_storeu_si128((__m128i*)(out + i), _mm_add_epi8(x, b));
+	}
+#endif
 
-		if(i >= stride)
-			a = out[i - stride];
+	for(; i < len; i++)
+		out[i] = in[i] + prev_line[i];
+}
 
-		sum = a;
-		sum += b;
+static void png_filter_average(int stride, const unsigned char* in, unsigned char* out,
+			       const unsigned char* prev_line, size_t len)
+{
+	size_t i;
 
-		out[i] = (char)(in[i] + sum/2);
+#ifdef __SSE2__
+	if(stride == 3 || stride == 4)
+	{
+		png_filter_average_sse2(stride, in, out, prev_line, len);
+		return;
 	}
+#endif
+
+	for(i = 0; i < (size_t)stride && i < len; i++)
+		out[i] = in[i] + (prev_line[i] >> 1);
+
+	for(; i < len; i++)
+		out[i] = in[i] + ((out[i - stride] + prev_line[i]) >> 1);
+}
+
+/* average filter for the first row, where the row above is all zeros */
+static void png_filter_average_first(int stride, const unsigned char* in, unsigned char* out, size_t len)
+{
+	size_t i;
+
+	for(i = 0; i < (size_t)stride && i < len; i++)
+		out[i] = in[i];
+
+	for(; i < len; i++)
+		out[i] = in[i] + (out[i - stride] >> 1);
 }
 
 static unsigned char png_paeth(unsigned char a, unsigned char b, unsigned char c)
@@ -666,116 +882,215 @@ static unsigned char png_paeth(unsigned char a, unsigned char b, unsigned char c
 	return (char)pr;
 }
 
-static void png_filter_paeth(int stride, unsigned char* in, unsigned char* out, unsigned char* prev_line, int len)
+static void png_filter_paeth(int stride, const unsigned char* in, unsigned char* out,
+			     const unsigned char* prev_line, size_t len)
 {
-	int i;
-	unsigned char a;
-	unsigned char b;
-	unsigned char c;
+	size_t i;
 
-	for(i = 0; i < len; i++)
+#ifdef __SSE2__
+	if(stride == 3 || stride == 4)
 	{
-		if(prev_line && i >= stride)
-		{
-			a = out[i - stride];
-			b = prev_line[i];
-			c = prev_line[i - stride];
-		}
-		else
-		{
-			if(prev_line)
-				b = prev_line[i];
-			else
-				b = 0;
-
-			if(i >= stride)
-				a = out[i - stride];
-			else
-				a = 0;
+		png_filter_paeth_sse2(stride, in, out, prev_line, len);
+		return;
+	}
+#endif
 
-			c = 0;
-		}
+	/* with a = c = 0 the predictor is always b */
+	for(i = 0; i < (size_t)stride && i < len; i++)
+		out[i] = in[i] + prev_line[i];
 
-		out[i] = in[i] + png_paeth(a, b, c);
-	}
+	for(; i < len; i++)
+		out[i] = in[i] + png_paeth(out[i - stride], prev_line[i], prev_line[i - stride]);
 }
 
-static int png_filter(png_t* png, unsigned char* data)
+/* reconstruct one row (in may be the same as out); prev_line is NULL for the first row */
+static int png_unfilter_row(int stride, unsigned char filter, const unsigned char* in, unsigned char* out,
+			    const unsigned char* prev_line, size_t len)
 {
-	(void) png;
-	(void) data;
+	/* above the first row everything is 0, so up is the same as none and paeth the same as sub */
+	if(!prev_line)
+	{
+		if(filter == 2)
+			filter = 0;
+		else if(filter == 4)
+			filter = 1;
+	}
+
+	switch(filter)
+	{
+	case 0: /* none */
+		if(out != in)
+			memcpy(out, in, len);
+		break;
+	case 1: /* sub */
+		png_filter_sub(stride, in, out, len);
+		break;
+	case 2: /* up */
+		png_filter_up(in, out, prev_line, len);
+		break;
+	case 3: /* average */
+		if(prev_line)
+			png_filter_average(stride, in, out, prev_line, len);
+		else
+			png_filter_average_first(stride, in, out, len);
+		break;
+	case 4: /* paeth */
+		png_filter_paeth(stride, in, out, prev_line, len);
+		break;
+	default:
+		return PNG_UNKNOWN_FILTER;
+	}
+
 	return PNG_NO_ERROR;
 }
 
-static int png_unfilter(png_t* png, unsigned char* data)
+/*
+	Convert a reconstructed 8-bit RGB or RGBA row to one unsigned per pixel, 0xRRGGBBAA in the host's byte
+	order. The row has just been unfiltered, so it's still in cache.
+*/
+static void png_row_to_rgba(int bpp, const unsigned char* row, unsigned* out, unsigned width, size_t avail)
 {
-	unsigned i;
-	unsigned pos = 0;
-	unsigned outpos = 0;
-	unsigned char *filtered = png->png_data;
+	unsigned x = 0;
 
-	int stride = png->bpp;
+#ifdef __SSE2__
+	/* x86 is little endian, so each pixel's bytes are reversed: A B G R */
+	__m128i alpha = _mm_set1_epi32(0xFF);
+	__m128i v;
 
-	while(pos < png->png_datalen)
+	/* loads are 16 bytes, which for RGB rows is more than the 4 pixels used */
+	for(; x + 4 <= width && (size_t)x * bpp + 16 <= avail; x += 4)
 	{
-		unsigned char filter = filtered[pos];
+		v = _mm_loadu_si128((const __m128i*)(row + (size_t)x * bpp));
 
-		pos++;
-
-		if(png->depth == 16)
+		if(bpp == 3)
 		{
-			for(i = 0; i < png->width * stride; i+=2)
-			{
-				*(short*)(filtered+pos+i) = (filtered[pos+i] << 8) | filtered[pos+i+1];
-			}
+			/* spread the 4 pixels out to one per 32-bit lane */
+			v = _mm_unpacklo_epi64(_mm_unpacklo_epi32(v, _mm_srli_si128(v, 3)),
+					       _mm_unpacklo_epi32(_mm_srli_si128(v, 6), _mm_srli_si128(v, 9)));
 		}
 
-		switch(filter)
-		{
-		case 0: /* none */
-			memcpy(data+outpos, filtered+pos, png->width * stride);
-			break;
-		case 1: /* sub */
-			png_filter_sub(stride, filtered+pos, data+outpos, png->width * stride);
-			break;
-		case 2: /* up */
-			if(outpos)
-				png_filter_up(stride, filtered+pos, data+outpos, data + outpos - (png->width*stride), png->width*stride);
-			else
-				png_filter_up(stride, filtered+pos, data+outpos, 0, png->width*stride);
-			break;
-		case 3: /* average */
-			if(outpos)
-				png_filter_average(stride, filtered+pos, data+outpos, data + outpos - (png->width*stride), png->width*stride);
-			else
-				png_filter_average(stride, filtered+pos, data+outpos, 0, png->width*stride);
-			break;
-		case 4: /* paeth */
-			if(outpos)
-				png_filter_paeth(stride, filtered+pos, data+outpos, data + outpos - (png->width*stride), png->width*stride);
-			else
-				png_filter_paeth(stride, filtered+pos, data+outpos, 0, png->width*stride);
-			break;
-		default:
-			return PNG_UNKNOWN_FILTER;
-		}
+		/* swap the bytes in each 16-bit lane, then the 16-bit halves of each pixel */
+		v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+		v = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1)), _MM_SHUFFLE(2, 3, 0, 1));
 
-		outpos += png->width * stride;
-		pos += png->width * stride;
+		if(bpp == 3)
+			v = _mm_or_si128(v, alpha);
+
+		_mm_storeu_si128((__m128i*)(out + x), v);
 	}
+#else
+	(void) avail;
+#endif
 
-	return PNG_NO_ERROR;
+	for(; x < width; x++)
+	{
+		const unsigned char *p = row + (size_t)x * bpp;
+
+		out[x] = ((unsigned)p[0] << 24) | ((unsigned)p[1] << 16) | ((unsigned)p[2] << 8) | (bpp == 4 ? p[3] : 0xFF);
+	}
 }
 
-int png_get_data(png_t* png, unsigned char* data)
+/* Look up each pixel of a reconstructed indexed row in the palette. Indices past the end of the palette are
+   an error in the png; they come out as opaque black. */
+static void png_indexed_row_to_rgba(png_t* png, const unsigned char* row, unsigned* out)
 {
-	int result = PNG_NO_ERROR;
+	unsigned x;
+	unsigned depth = png->depth;
+	unsigned mask = (1U << depth) - 1;
+	unsigned pixels_per_byte = 8 / depth;
 
-	png->zs = NULL;
-	png->png_datalen = 0;
-	png->png_data = NULL;
+	if(depth == 8)
+	{
+		for(x = 0; x < png->width; x++)
+			out[x] = png->palette[row[x]];
+		return;
+	}
+
+	/* the leftmost pixel is in the most significant bits */
+	for(x = 0; x < png->width; x++)
+	{
+		unsigned shift = 8 - depth * (x % pixels_per_byte + 1);
+
+		out[x] = png->palette[(row[x / pixels_per_byte] >> shift) & mask];
+	}
+}
+
+/*
+	Reconstruct the row that has just been inflated into png_data. For png_get_data it's written straight to its
+	place in out_data, where it's the previous row for the next one. For png_get_rgba it's reconstructed in place
+	and converted into out_rgba, and png_data and png_prev are swapped so the raw row is kept for the next one.
+*/
+static int png_decode_row(png_t* png)
+{
+	unsigned i;
+	unsigned char *filtered = png->png_data + 1;
+	unsigned char *prev_line = NULL;
+	unsigned char *out;
+	unsigned char *tmp;
+	int result;
+
+	int stride = png->bpp;
+	size_t row_len = png_get_row_len(png);
+
+	if(png->depth == 16)
+	{
+		for(i = 0; i < row_len; i+=2)
+		{
+			*(short*)(filtered+i) = (filtered[i] << 8) | filtered[i+1];
+		}
+	}
+
+	if(png->out_rgba)
+	{
+		out = filtered;
+		if(png->rows_read > 0)
+			prev_line = png->png_prev + 1;
+	}
+	else
+	{
+		out = png->out_data + png->rows_read * row_len;
+		if(png->rows_read > 0)
+			prev_line = out - row_len;
+	}
+
+	result = png_unfilter_row(stride, png->png_data[0], filtered, out, prev_line, row_len);
+	if(result != PNG_NO_ERROR)
+		return result;
+
+	if(png->out_rgba)
+	{
+		if(png->color_type == PNG_INDEXED)
+			png_indexed_row_to_rgba(png, out, png->out_rgba + (size_t)png->rows_read * png->width);
+		else
+			png_row_to_rgba(stride, out, png->out_rgba + (size_t)png->rows_read * png->width, png->width,
+					row_len);
+
+		tmp = png->png_prev;
+		png->png_prev = png->png_data;
+		png->png_data = tmp;
+	}
+
+	png->rows_read++;
+	png->row_fill = 0;
+
+	return PNG_NO_ERROR;
+}
+
+/* read the chunks, decoding the image data into data or rgba as it arrives */
+static int png_decode(png_t* png, unsigned char* data, unsigned* rgba)
+{
+	int result = PNG_NO_ERROR;
+
+	png->zs = NULL;
+	png->png_datalen = 0;
+	png->png_data = NULL;
+	png->png_prev = NULL;
 	png->readbuf = NULL;
 	png->readbuflen = 0;
+	png->out_data = data;
+	png->out_rgba = rgba;
+	png->rows_read = 0;
+	png->row_fill = 0;
 
 	while(result == PNG_NO_ERROR)
 	{
@@ -792,47 +1107,760 @@ int png_get_data(png_t* png, unsigned char* data)
 		png_end_inflate(png);
 	}
 
-	if(result != PNG_DONE)
+	png_free(png->png_data);
+	png_free(png->png_prev);
+	png->png_data = NULL;
+	png->png_prev = NULL;
+
+	return result == PNG_DONE ? PNG_NO_ERROR : result;
+}
+
+int png_get_data(png_t* png, unsigned char* data)
+{
+	return png_decode(png, data, NULL);
+}
+
+int png_get_rgba(png_t* png, unsigned* data)
+{
+	if(png->color_type != PNG_INDEXED &&
+	   (png->depth != 8 || (png->color_type != PNG_TRUECOLOR && png->color_type != PNG_TRUECOLOR_ALPHA)))
+		return PNG_WRONG_ARGUMENTS;
+
+	return png_decode(png, NULL, data);
+}
+
+/*
+	Filtering for the row writer. Each row is filtered with all five filter types at once and the one whose
+	output has the smallest sum of absolute values (taking the bytes as signed) is kept, which is the usual
+	heuristic for picking filters. rowbuf and prevbuf hold the current and previous raw rows after
+	PNG_ROW_PAD zero bytes, so the bytes to the left of the first pixel read as 0 without any special cases.
+*/
+#define PNG_ROW_PAD 16
+
+/* filter bytes [start, len) of a row with each filter type, adding to the per-filter sums */
+static void png_filter_row_scalar(const unsigned char* row, const unsigned char* prev, int bpp, size_t start,
+				  size_t len, unsigned char* out[5], unsigned long sums[5])
+{
+	size_t i;
+	unsigned char x, a, b, c, f[5];
+	int k;
+
+	for(i = start; i < len; i++)
+	{
+		x = row[i];
+		a = row[(ptrdiff_t)i - bpp];
+		b = prev[i];
+		c = prev[(ptrdiff_t)i - bpp];
+
+		f[0] = x;
+		f[1] = x - a;
+		f[2] = x - b;
+		f[3] = x - ((a + b) >> 1);
+		f[4] = x - png_paeth(a, b, c);
+
+		for(k = 0; k < 5; k++)
+		{
+			out[k][i] = f[k];
+			sums[k] += f[k] < 128 ? f[k] : 256 - f[k];
+		}
+	}
+}
+
+#ifdef __SSE2__
+/* sum of the absolute values of 16 signed bytes, as two 64-bit lanes */
+static __m128i png_abs_sum_sse2(__m128i v)
+{
+	__m128i neg = _mm_sub_epi8(_mm_setzero_si128(), v);
+
+	return _mm_sad_epu8(_mm_min_epu8(v, neg), _mm_setzero_si128());
+}
+
+static void png_filter_row(const unsigned char* row, const unsigned char* prev, int bpp, size_t len,
+			   unsigned char* out[5], unsigned long sums[5])
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i acc[5];
+	unsigned long long lanes[2];
+	size_t i;
+	int k;
+
+	for(k = 0; k < 5; k++)
+		acc[k] = zero;
+
+	for(i = 0; i + 16 <= len; i += 16)
 	{
-		png_free(png->png_data);
-		return result;
+		__m128i x = _mm_loadu_si128((const __m128i*)(row + i));
+		__m128i a = _mm_loadu_si128((const __m128i*)(row + i - bpp));
+		__m128i b = _mm_loadu_si128((const __m128i*)(prev + i));
+		__m128i c = _mm_loadu_si128((const __m128i*)(prev + i - bpp));
+		__m128i f[5];
+
+		f[0] = x;
+		f[1] = _mm_sub_epi8(x, a);
+		f[2] = _mm_sub_epi8(x, b);
+		/* avg_epu8 rounds up, so take off the low bit that rounding added */
+		f[3] = _mm_sub_epi8(x, _mm_sub_epi8(_mm_avg_epu8(a, b),
+						    _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1))));
+		f[4] = _mm_sub_epi8(x, _mm_packus_epi16(
+			png_paeth_sse2(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(c, zero)),
+			png_paeth_sse2(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(c, zero))));
+
+		for(k = 0; k < 5; k++)
+		{
+			_mm_storeu_si128((__m128i*)(out[k] + i), f[k]);
+			acc[k] = _mm_add_epi64(acc[k], png_abs_sum_sse2(f[k]));
+		}
 	}
 
-	result = png_unfilter(png, data);
+	for(k = 0; k < 5; k++)
+	{
+		_mm_storeu_si128((__m128i*)lanes, acc[k]);
+		sums[k] += lanes[0] + lanes[1];
+	}
 
-	png_free(png->png_data);
+	png_filter_row_scalar(row, prev, bpp, i, len, out, sums);
+}
+#else
+static void png_filter_row(const unsigned char* row, const unsigned char* prev, int bpp, size_t len,
+			   unsigned char* out[5], unsigned long sums[5])
+{
+	png_filter_row_scalar(row, prev, bpp, 0, len, out, sums);
+}
+#endif
+
+/* filter a row, using filterbuf for the five filtered rows, and return the filter type byte + filtered row to
+   compress; row and prev must each follow PNG_ROW_PAD zero bytes */
+static unsigned char* png_filter_best(png_t* png, const unsigned char* row, const unsigned char* prev,
+				      unsigned char* filterbuf, size_t row_len)
+{
+	unsigned char *out[5];
+	unsigned long sums[5] = { 0, 0, 0, 0, 0 };
+	int k, best = 0;
+
+	for(k = 0; k < 5; k++)
+	{
+		out[k] = filterbuf + k * (row_len + 1) + 1;
+		out[k][-1] = (unsigned char)k;
+	}
+
+	/* with no compression there's nothing to gain from filtering, and palette indices aren't smooth enough to
+	   predict */
+	if(png->compression_level == 0 || png->color_type == PNG_INDEXED)
+	{
+		memcpy(out[0], row, row_len);
+		return out[0] - 1;
+	}
+
+	png_filter_row(row, prev, png->bpp, row_len, out, sums);
+
+	for(k = 1; k < 5; k++)
+	{
+		if(sums[k] < sums[best])
+			best = k;
+	}
+
+	return out[best] - 1;
+}
+
+/* write the compressed data in writebuf as an IDAT chunk */
+static int png_write_idat_chunk(png_t* png, unsigned length)
+{
+	if(length == 0)
+		return PNG_NO_ERROR;
+
+	return png_write_chunk(png, png->writebuf, length);
+}
+
+/* run the compressor on the pending input, writing out an IDAT chunk each time writebuf fills up */
+static int png_deflate_rows(png_t* png, int flush)
+{
+	z_stream *stream = png->zs;
+	int result;
+
+	do
+	{
+		result = deflate(stream, flush);
+
+		if(result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR)
+			return PNG_ZLIB_ERROR;
+
+		if(stream->avail_out == 0 || result == Z_STREAM_END)
+		{
+			if(png_write_idat_chunk(png, PNG_IDAT_SIZE - stream->avail_out) != PNG_NO_ERROR)
+				return PNG_IO_ERROR;
+
+			stream->next_out = png->writebuf + 4;
+			stream->avail_out = PNG_IDAT_SIZE;
+		}
+	} while(stream->avail_in != 0 || (flush == Z_FINISH && result != Z_STREAM_END));
+
+	return PNG_NO_ERROR;
+}
+
+/*
+	Parallel writing. With png->num_threads above 1, rows are gathered into horizontal strips of about
+	PNG_STRIP_SIZE bytes, and each strip is filtered and deflated as a raw deflate stream of its own by a pool of
+	worker threads. Every strip but the last ends with a full flush, which leaves the output byte aligned, so the
+	strips can simply be concatenated after a zlib header; the last one finishes the stream, and the adler32 of
+	the whole image, combined from the strips' adler32s, follows it. The strips are written out in order as soon
+	as they are done, so only a ring of 2*num_threads strips is ever held in memory.
+*/
+enum
+{
+	PNG_STRIP_FREE,
+	PNG_STRIP_QUEUED,
+	PNG_STRIP_RUNNING,
+	PNG_STRIP_DONE
+};
+
+typedef struct
+{
+	unsigned char*		rows;		/* the row above the strip, then its rows, each after PNG_ROW_PAD zeros */
+	unsigned char*		filterbuf;
+	unsigned char*		out;		/* the compressed strip */
+	size_t			out_len;
+	size_t			out_size;
+	unsigned		num_rows;
+	int			last;		/* the last strip, which finishes the zlib stream */
+	uLong			adler;		/* adler32 of the filtered strip */
+	int			state;		/* one of PNG_STRIP_* */
+	int			result;
+} png_strip_t;
+
+typedef struct
+{
+	png_t*			png;
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	pthread_t*		threads;
+	int			num_threads;
+	int			quit;
+	png_strip_t*		strips;		/* ring of strips, written out in order */
+	unsigned		num_strips;
+	unsigned		oldest;		/* the next strip to write out */
+	unsigned		num_pending;	/* strips handed to the workers but not written out yet */
+	int			filling;	/* rows are being added to the strip after the pending ones */
+	unsigned		rows_per_strip;
+	size_t			row_len;
+	size_t			stride;		/* PNG_ROW_PAD + row_len */
+	unsigned char*		prev_row;	/* the last row of the last strip, after PNG_ROW_PAD zeros */
+	unsigned		idat_fill;	/* bytes of compressed data in writebuf */
+	uLong			adler;		/* adler32 of the strips written out so far */
+} png_parallel_t;
+
+#define PNG_STRIP_ROW(par, strip, i) ((strip)->rows + (i) * (par)->stride + PNG_ROW_PAD)
+
+/* append compressed data to the IDAT chunk being built in writebuf, writing it out each time it fills up */
+static int png_write_idat_data(png_t* png, png_parallel_t* par, const unsigned char* data, size_t len)
+{
+	size_t n;
+
+	while(len > 0)
+	{
+		n = PNG_IDAT_SIZE - par->idat_fill;
+		if(n > len)
+			n = len;
+
+		memcpy(png->writebuf + 4 + par->idat_fill, data, n);
+		par->idat_fill += n;
+		data += n;
+		len -= n;
+
+		if(par->idat_fill == PNG_IDAT_SIZE)
+		{
+			if(png_write_idat_chunk(png, PNG_IDAT_SIZE) != PNG_NO_ERROR)
+				return PNG_IO_ERROR;
+			par->idat_fill = 0;
+		}
+	}
+
+	return PNG_NO_ERROR;
+}
+
+/* run a strip's compressor on its pending input, growing the output buffer as needed */
+static int png_deflate_strip_data(z_stream* stream, png_strip_t* strip, int flush)
+{
+	unsigned char *out;
+	int result;
+
+	do
+	{
+		if(strip->out_len == strip->out_size)
+		{
+			out = png_alloc(strip->out_size * 2);
+			if(!out)
+				return PNG_MEMORY_ERROR;
+			memcpy(out, strip->out, strip->out_len);
+			png_free(strip->out);
+			strip->out = out;
+			strip->out_size *= 2;
+		}
+
+		stream->next_out = strip->out + strip->out_len;
+		stream->avail_out = strip->out_size - strip->out_len;
+
+		result = deflate(stream, flush);
+
+		if(result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR)
+			return PNG_ZLIB_ERROR;
+
+		strip->out_len = strip->out_size - stream->avail_out;
+	} while(stream->avail_in != 0 || (flush != Z_NO_FLUSH && stream->avail_out == 0) ||
+		(flush == Z_FINISH && result != Z_STREAM_END));
+
+	return PNG_NO_ERROR;
+}
+
+/* filter and deflate one strip, on a worker thread */
+static int png_deflate_strip(png_parallel_t* par, png_strip_t* strip)
+{
+	z_stream stream;
+	unsigned char *data;
+	unsigned i;
+	int flush;
+	int result = PNG_NO_ERROR;
+
+	memset(&stream, 0, sizeof(stream));
+	if(deflateInit2(&stream, par->png->compression_level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		return PNG_ZLIB_ERROR;
+
+	strip->out_len = 0;
+	strip->adler = adler32(0L, Z_NULL, 0);
+
+	for(i = 1; i <= strip->num_rows && result == PNG_NO_ERROR; i++)
+	{
+		data = png_filter_best(par->png, PNG_STRIP_ROW(par, strip, i), PNG_STRIP_ROW(par, strip, i - 1),
+				       strip->filterbuf, par->row_len);
+		strip->adler = adler32(strip->adler, data, par->row_len + 1);
+
+		if(i < strip->num_rows)
+			flush = Z_NO_FLUSH;
+		else
+			flush = strip->last ? Z_FINISH : Z_FULL_FLUSH;
+
+		stream.next_in = data;
+		stream.avail_in = par->row_len + 1;
+		result = png_deflate_strip_data(&stream, strip, flush);
+	}
+
+	deflateEnd(&stream);
 
 	return result;
 }
 
-int png_set_data(png_t* png, unsigned width, unsigned height, char depth, int color, unsigned char* data)
+static void* png_parallel_worker(void* arg)
+{
+	png_parallel_t* par = arg;
+	png_strip_t* strip;
+	unsigned i;
+	int result;
+
+	pthread_mutex_lock(&par->lock);
+	for(;;)
+	{
+		/* take the oldest strip waiting to be compressed */
+		strip = NULL;
+		for(i = 0; i < par->num_pending && !strip; i++)
+		{
+			if(par->strips[(par->oldest + i) % par->num_strips].state == PNG_STRIP_QUEUED)
+				strip = &par->strips[(par->oldest + i) % par->num_strips];
+		}
+
+		if(strip)
+		{
+			strip->state = PNG_STRIP_RUNNING;
+			pthread_mutex_unlock(&par->lock);
+			result = png_deflate_strip(par, strip);
+			pthread_mutex_lock(&par->lock);
+			strip->result = result;
+			strip->state = PNG_STRIP_DONE;
+			pthread_cond_broadcast(&par->cond);
+		}
+		else if(par->quit)
+			break;
+		else
+			pthread_cond_wait(&par->cond, &par->lock);
+	}
+	pthread_mutex_unlock(&par->lock);
+
+	return NULL;
+}
+
+/* wait for the oldest pending strip, and write it out if write is set */
+static int png_parallel_write_oldest(png_t* png, png_parallel_t* par, int write)
+{
+	png_strip_t* strip = &par->strips[par->oldest];
+	int result;
+
+	pthread_mutex_lock(&par->lock);
+	while(strip->state != PNG_STRIP_DONE)
+		pthread_cond_wait(&par->cond, &par->lock);
+	pthread_mutex_unlock(&par->lock);
+
+	result = strip->result;
+	if(write && result == PNG_NO_ERROR)
+	{
+		result = png_write_idat_data(png, par, strip->out, strip->out_len);
+		par->adler = adler32_combine(par->adler, strip->adler, (z_off_t)strip->num_rows * (par->row_len + 1));
+	}
+
+	pthread_mutex_lock(&par->lock);
+	strip->state = PNG_STRIP_FREE;
+	par->oldest = (par->oldest + 1) % par->num_strips;
+	par->num_pending--;
+	pthread_mutex_unlock(&par->lock);
+
+	return result;
+}
+
+static void png_parallel_free(png_t* png)
+{
+	png_parallel_t* par = png->parallel;
+	unsigned i;
+
+	if(!par)
+		return;
+
+	if(par->threads)
+	{
+		/* let the workers finish what they have */
+		while(par->num_pending > 0)
+			png_parallel_write_oldest(png, par, 0);
+
+		pthread_mutex_lock(&par->lock);
+		par->quit = 1;
+		pthread_cond_broadcast(&par->cond);
+		pthread_mutex_unlock(&par->lock);
+
+		for(i = 0; i < (unsigned)par->num_threads; i++)
+			pthread_join(par->threads[i], NULL);
+
+		pthread_cond_destroy(&par->cond);
+		pthread_mutex_destroy(&par->lock);
+		png_free(par->threads);
+	}
+
+	if(par->strips)
+	{
+		for(i = 0; i < par->num_strips; i++)
+		{
+			png_free(par->strips[i].rows);
+			png_free(par->strips[i].filterbuf);
+			png_free(par->strips[i].out);
+		}
+		png_free(par->strips);
+	}
+	png_free(par->prev_row);
+	png_free(par);
+	png->parallel = NULL;
+}
+
+/* set up parallel writing, if png->num_threads asks for it and the image has more than one strip; returns
+   PNG_NO_ERROR if the png is to be written in parallel */
+static int png_parallel_begin(png_t* png, size_t row_len)
 {
-	//int i;
+	png_parallel_t* par;
+	size_t strip_size;
 	unsigned i;
-	unsigned char *filtered;
+	int level;
+	unsigned char header[2];
+
+	if(png->num_threads <= 1 || (size_t)png->height * (row_len + 1) <= PNG_STRIP_SIZE)
+		return PNG_WRONG_ARGUMENTS;
+
+	par = png_alloc(sizeof(png_parallel_t));
+	if(!par)
+		return PNG_MEMORY_ERROR;
+	memset(par, 0, sizeof(png_parallel_t));
+	png->parallel = par;
+
+	par->png = png;
+	par->row_len = row_len;
+	par->stride = PNG_ROW_PAD + row_len;
+	par->rows_per_strip = PNG_STRIP_SIZE / (row_len + 1);
+	if(par->rows_per_strip == 0)
+		par->rows_per_strip = 1;
+	par->num_strips = 2 * png->num_threads;
+	par->adler = adler32(0L, Z_NULL, 0);
+
+	strip_size = (size_t)par->rows_per_strip * (row_len + 1);
+	par->prev_row = png_alloc(par->stride);
+	par->strips = png_alloc(par->num_strips * sizeof(png_strip_t));
+	if(!par->prev_row || !par->strips)
+	{
+		png_parallel_free(png);
+		return PNG_MEMORY_ERROR;
+	}
+	memset(par->prev_row, 0, par->stride);
+	memset(par->strips, 0, par->num_strips * sizeof(png_strip_t));
+
+	for(i = 0; i < par->num_strips; i++)
+	{
+		png_strip_t* strip = &par->strips[i];
+
+		strip->rows = png_alloc((par->rows_per_strip + 1) * par->stride);
+		strip->filterbuf = png_alloc(5 * (row_len + 1));
+		strip->out_size = compressBound(strip_size) + 64;
+		strip->out = png_alloc(strip->out_size);
+		if(!strip->rows || !strip->filterbuf || !strip->out)
+		{
+			png_parallel_free(png);
+			return PNG_MEMORY_ERROR;
+		}
+		/* the padding before each row stays zero */
+		memset(strip->rows, 0, (par->rows_per_strip + 1) * par->stride);
+	}
+
+	par->threads = png_alloc(png->num_threads * sizeof(pthread_t));
+	if(!par->threads)
+	{
+		png_parallel_free(png);
+		return PNG_MEMORY_ERROR;
+	}
+	pthread_mutex_init(&par->lock, NULL);
+	pthread_cond_init(&par->cond, NULL);
+	while(par->num_threads < png->num_threads &&
+	      pthread_create(&par->threads[par->num_threads], NULL, png_parallel_worker, par) == 0)
+		par->num_threads++;
+
+	if(par->num_threads == 0)
+	{
+		png_parallel_free(png);
+		return PNG_MEMORY_ERROR;
+	}
+
+	/* the zlib header, with the same compression level hint deflate would give it */
+	level = png->compression_level == Z_DEFAULT_COMPRESSION ? 6 : png->compression_level;
+	header[0] = 0x78;
+	header[1] = (level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3) << 6;
+	header[1] += 31 - (header[0] * 256 + header[1]) % 31;
+
+	return png_write_idat_data(png, par, header, 2);
+}
+
+static int png_parallel_write_row(png_t* png, const unsigned char* row)
+{
+	png_parallel_t* par = png->parallel;
+	png_strip_t* strip;
+	int result = PNG_NO_ERROR;
+
+	/* start a new strip, making room for it if all of them are in use */
+	if(!par->filling)
+	{
+		if(par->num_pending == par->num_strips)
+			result = png_parallel_write_oldest(png, par, 1);
+
+		strip = &par->strips[(par->oldest + par->num_pending) % par->num_strips];
+		memcpy(PNG_STRIP_ROW(par, strip, 0), par->prev_row + PNG_ROW_PAD, par->row_len);
+		strip->num_rows = 0;
+		par->filling = 1;
+	}
+
+	strip = &par->strips[(par->oldest + par->num_pending) % par->num_strips];
+	strip->num_rows++;
+	memcpy(PNG_STRIP_ROW(par, strip, strip->num_rows), row, par->row_len);
+	png->rows_written++;
+
+	if(strip->num_rows == par->rows_per_strip || png->rows_written == png->height)
+	{
+		memcpy(par->prev_row + PNG_ROW_PAD, PNG_STRIP_ROW(par, strip, strip->num_rows), par->row_len);
+		strip->last = png->rows_written == png->height;
+		par->filling = 0;
+
+		pthread_mutex_lock(&par->lock);
+		strip->state = PNG_STRIP_QUEUED;
+		par->num_pending++;
+		pthread_cond_signal(&par->cond);
+		pthread_mutex_unlock(&par->lock);
+	}
+
+	return result;
+}
+
+/* write out the rest of the strips, the adler32 and the last IDAT chunk */
+static int png_parallel_finish(png_t* png)
+{
+	png_parallel_t* par = png->parallel;
+	unsigned char adler[4];
+	int result = PNG_NO_ERROR;
+
+	while(par->num_pending > 0)
+	{
+		if(result == PNG_NO_ERROR)
+			result = png_parallel_write_oldest(png, par, 1);
+		else
+			png_parallel_write_oldest(png, par, 0);
+	}
+
+	if(result != PNG_NO_ERROR)
+		return result;
+
+	set_ul(adler, par->adler);
+	result = png_write_idat_data(png, par, adler, 4);
+	if(result == PNG_NO_ERROR)
+		result = png_write_idat_chunk(png, par->idat_fill);
+
+	return result;
+}
+
+int png_write_begin(png_t* png, unsigned width, unsigned height, char depth, int color)
+{
+	z_stream *stream;
+	size_t row_len;
+	int result;
+
 	png->width = width;
 	png->height = height;
 	png->depth = depth;
 	png->color_type = color;
 	png->bpp = png_get_bpp(png);
+	png->rows_written = 0;
+
+	row_len = png_get_row_len(png);
+	png->zs = NULL;
+	png->parallel = NULL;
+	png->rowbuf = png_alloc(PNG_ROW_PAD + row_len);
+	png->prevbuf = png_alloc(PNG_ROW_PAD + row_len);
+	png->filterbuf = png_alloc(5 * (row_len + 1));
+	png->writebuf = png_alloc(PNG_IDAT_SIZE + 4);
+
+	if(!png->rowbuf || !png->prevbuf || !png->filterbuf || !png->writebuf)
+		return PNG_MEMORY_ERROR;
+
+	if(color == PNG_INDEXED &&
+	   ((depth != 1 && depth != 2 && depth != 4 && depth != 8) ||
+	    png->palette_size == 0 || png->palette_size > (1U << depth)))
+		return PNG_WRONG_ARGUMENTS;
+
+	/* the row above the first row is all zeros */
+	memset(png->rowbuf, 0, PNG_ROW_PAD);
+	memset(png->prevbuf, 0, PNG_ROW_PAD + row_len);
 
-	filtered = png_alloc(width * height * png->bpp + height);
+	memcpy(png->writebuf, "IDAT", 4);
 
-	for(i = 0; i < png->height; i++)
+	/* if the image can't be written in parallel, it's compressed as one stream on this thread */
+	if(png_parallel_begin(png, row_len) != PNG_NO_ERROR)
 	{
-		filtered[i*png->width*png->bpp+i] = 0;
-		memcpy(&filtered[i*png->width*png->bpp+i+1], data + i * png->width*png->bpp, png->width*png->bpp);
+		png->zs = png_alloc(sizeof(z_stream));
+		if(!png->zs)
+			return PNG_MEMORY_ERROR;
+
+		stream = png->zs;
+		memset(stream, 0, sizeof(z_stream));
+
+		if(deflateInit(stream, png->compression_level) != Z_OK)
+		{
+			png_free(png->zs);
+			png->zs = NULL;
+			return PNG_ZLIB_ERROR;
+		}
+
+		stream->next_out = png->writebuf + 4;
+		stream->avail_out = PNG_IDAT_SIZE;
 	}
 
-	png_filter(png, filtered);
-	png_write_ihdr(png);
-	png_write_idats(png, filtered);
+	result = png_write_ihdr(png);
+	if(result != PNG_NO_ERROR)
+		return result;
 
-	png_free(filtered);
+	if(color == PNG_INDEXED)
+		return png_write_palette(png);
 
 	return PNG_NO_ERROR;
 }
 
+int png_write_row(png_t* png, const unsigned char* row)
+{
+	z_stream *stream = png->zs;
+	size_t row_len = png_get_row_len(png);
+	unsigned char *tmp;
+	int result;
+
+	if((!stream && !png->parallel) || !png->rowbuf || !png->prevbuf || !png->filterbuf || !png->writebuf ||
+	   png->rows_written >= png->height)
+		return PNG_WRONG_ARGUMENTS;
+
+	if(png->parallel)
+		return png_parallel_write_row(png, row);
+
+	memcpy(png->rowbuf + PNG_ROW_PAD, row, row_len);
+
+	stream->next_in = png_filter_best(png, png->rowbuf + PNG_ROW_PAD, png->prevbuf + PNG_ROW_PAD, png->filterbuf,
+					  row_len);
+	stream->avail_in = row_len + 1;
+	png->rows_written++;
+
+	result = png_deflate_rows(png, Z_NO_FLUSH);
+
+	/* this row is the previous row for the next one */
+	tmp = png->prevbuf;
+	png->prevbuf = png->rowbuf;
+	png->rowbuf = tmp;
+
+	return result;
+}
+
+int png_write_end(png_t* png)
+{
+	int result;
+	unsigned crc;
+
+	if((!png->zs && !png->parallel) || !png->rowbuf || !png->prevbuf || !png->filterbuf || !png->writebuf)
+		result = PNG_MEMORY_ERROR;
+	else if(png->rows_written != png->height)
+		result = PNG_WRONG_ARGUMENTS;
+	else if(png->parallel)
+		result = png_parallel_finish(png);
+	else
+		result = png_deflate_rows(png, Z_FINISH);
+
+	if(result == PNG_NO_ERROR)
+	{
+		crc = crc32(0L, (const unsigned char *)"IEND", 4);
+
+		if(file_write_ul(png, 0) != PNG_NO_ERROR ||
+		   file_write(png, "IEND", 1, 4) != 4 ||
+		   file_write_ul(png, crc) != PNG_NO_ERROR)
+			result = PNG_IO_ERROR;
+	}
+
+	if(png->zs)
+	{
+		deflateEnd(png->zs);
+		png_free(png->zs);
+	}
+	png_parallel_free(png);
+	png_free(png->rowbuf);
+	png_free(png->prevbuf);
+	png_free(png->filterbuf);
+	png_free(png->writebuf);
+	png->zs = NULL;
+	png->rowbuf = NULL;
+	png->prevbuf = NULL;
+	png->filterbuf = NULL;
+	png->writebuf = NULL;
+
+	return result;
+}
+
+int png_set_data(png_t* png, unsigned width, unsigned height, char depth, int color, unsigned char* data)
+{
+	unsigned i;
+	int result;
+	size_t row_len;
+
+	result = png_write_begin(png, width, height, depth, color);
+	row_len = png_get_row_len(png);
+
+	for(i = 0; i < height && result == PNG_NO_ERROR; i++)
+		result = png_write_row(png, data + i * row_len);
+
+	if(png_write_end(png) != PNG_NO_ERROR && result == PNG_NO_ERROR)
+		result = PNG_IO_ERROR;
+
+	return result;
+}
+
 char* png_error_string(int error)
 {
 	switch(error)
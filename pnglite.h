@@ -89,7 +89,7 @@ typedef struct
 	png_write_callback_t		write_fun;
 	void*				user_pointer;
 
-	unsigned char*			png_data;
+	unsigned char*			png_data;		/* filter type byte + the row being inflated */
 	unsigned			png_datalen;
 
 	unsigned			width;
@@ -103,6 +103,24 @@ typedef struct
 
 	unsigned char*			readbuf;
 	unsigned			readbuflen;
+	unsigned char*			png_prev;		/* the previous raw row, laid out like png_data */
+	unsigned char*			out_data;		/* where png_get_data is storing the image */
+	unsigned*			out_rgba;		/* where png_get_rgba is storing the image */
+	unsigned			rows_read;
+	unsigned			row_fill;		/* bytes of png_data inflated so far */
+	const unsigned char*		mem;			/* the png's contents, for png_open_mem_read */
+	size_t				mem_size;
+	size_t				mem_pos;
+	unsigned char*			writebuf;		/* "IDAT" + compressed data of the chunk being written */
+	unsigned char*			rowbuf;			/* the row being written (after some zero padding) */
+	unsigned char*			prevbuf;		/* the previous row, laid out like rowbuf */
+	unsigned char*			filterbuf;		/* the row filtered with each filter type */
+	unsigned			rows_written;
+	int				compression_level;	/* zlib level, 0-9 or PNG_DEFAULT_COMPRESSION */
+	int				num_threads;		/* threads to compress with (see png_write_begin) */
+	void*				parallel;		/* the state of a png being compressed in parallel */
+	unsigned			palette[256];		/* PNG_INDEXED colors, 0xRRGGBBAA */
+	unsigned			palette_size;
 } png_t;
 
 /*
@@ -174,6 +192,24 @@ int png_open(png_t* png, png_read_callback_t read_fun, void* user_pointer);
 int png_open_read(png_t* png, png_read_callback_t read_fun, void* user_pointer);
 int png_open_write(png_t* png, png_write_callback_t write_fun, void* user_pointer);
 
+/*
+	Function: png_open_mem_read
+
+	This function opens a png that is already in memory, for example a memory mapped file, using an internal read
+	callback. IDAT data is inflated straight from the buffer instead of being copied out first. The buffer must
+	stay valid until the png has been decoded; png_close_file must not be called on the png.
+
+	Parameters:
+		png - Empty png_t struct.
+		data - The png file's contents.
+		size - Size of data in bytes.
+
+	Returns:
+		PNG_NO_ERROR on success, otherwise an error code.
+*/
+
+int png_open_mem_read(png_t* png, const void* data, size_t size);
+
 /*
 	Function: png_print_info
 
@@ -215,8 +251,92 @@ char* png_error_string(int error);
 
 int png_get_data(png_t* png, unsigned char* data);
 
+/*
+	Function: png_get_rgba
+
+	This function decodes an 8-bit truecolor or truecolor-alpha png, or an indexed png of any bit depth, to one
+	unsigned per pixel, holding 0xRRGGBBAA in the host's byte order. Truecolor pixels get an alpha of 255, and
+	indexed pixels get the alpha from the tRNS chunk if there is one. The rows are converted as they are
+	unfiltered, so no separate buffer or pass is needed. data should hold width*height unsigneds.
+
+	Parameters:
+		data - Where to store result.
+
+	Returns:
+		PNG_NO_ERROR on success, PNG_WRONG_ARGUMENTS if the png isn't 8-bit truecolor(-alpha) or indexed,
+		otherwise an error code.
+*/
+
+int png_get_rgba(png_t* png, unsigned* data);
+
 int png_set_data(png_t* png, unsigned width, unsigned height, char depth, int color, unsigned char* data);
 
+/*
+	Function: png_write_begin
+
+	This function starts writing a png one row at a time, so that the whole image never has to be in memory in
+	PNG form. It writes the header and prepares the compressor; the rows are then passed to png_write_row, from
+	top to bottom, and the png is finished with png_write_end. Compressed data is written out in IDAT chunks of
+	at most PNG_IDAT_SIZE bytes as it is produced, so memory use doesn't depend on the height of the image.
+
+	Each row is written with whichever of the five PNG filter types gives the smallest sum of absolute
+	differences. The zlib compression level can be chosen by setting png->compression_level (0-9) after
+	opening the png; it defaults to PNG_DEFAULT_COMPRESSION. Level 0 also skips filtering.
+
+	Setting png->num_threads above 1 (it defaults to 1) splits an image bigger than PNG_STRIP_SIZE bytes into
+	horizontal strips that are filtered and compressed on that many threads. The strips are joined with zlib
+	full flushes, so the result is still one zlib stream that any reader can decode; it's slightly bigger,
+	since each strip starts without the previous one as its dictionary.
+
+	For PNG_INDEXED, png->palette and png->palette_size must be set first; they're written as a PLTE chunk,
+	and the alpha values as a tRNS chunk if any of them isn't 255. Indexed rows are never filtered, and for
+	bit depths below 8 each row is packed with the leftmost pixel in the most significant bits.
+
+	Parameters:
+		png - png_t struct opened for writing.
+		width - Width of the image in pixels.
+		height - Height of the image in pixels.
+		depth - Bit depth (8 or 16, or 1, 2, 4 or 8 for PNG_INDEXED).
+		color - Color type (one of the PNG_* color types).
+
+	Returns:
+		PNG_NO_ERROR on success, otherwise an error code.
+*/
+#define PNG_IDAT_SIZE 65536
+#define PNG_STRIP_SIZE (256*1024)
+#define PNG_DEFAULT_COMPRESSION -1
+
+int png_write_begin(png_t* png, unsigned width, unsigned height, char depth, int color);
+
+/*
+	Function: png_write_row
+
+	This function compresses the next row of a png started with png_write_begin.
+
+	Parameters:
+		png - png_t struct.
+		row - The row's pixel data, width*(bits per pixel)/8 bytes, rounded up.
+
+	Returns:
+		PNG_NO_ERROR on success, otherwise an error code.
+*/
+int png_write_row(png_t* png, const unsigned char* row);
+
+/*
+	Function: png_write_end
+
+	This function finishes a png started with png_write_begin, writing the last IDAT chunk and the IEND chunk,
+	and frees the memory used for writing. It must be called even if an earlier call failed.
+
+	Parameters:
+		png - png_t struct.
+
+	Returns:
+		PNG_NO_ERROR on success, otherwise an error code (PNG_WRONG_ARGUMENTS if fewer than height rows were
+		written).
+*/
+int png_write_end(png_t* png);
+
 /*
 	Function: png_close_file
 
@@ -0,0 +1,657 @@
+// Buffered drawing commands, an optimization pass over them, and
+// serial and parallel rendering
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "image_cache.h"
+#include "scene.h"
+
+// bin_commands result when a command can't be moved into a bin
+#define IMG_ERR_NOT_BINNABLE -100
+
+// tiles are reordered within windows of at most this many commands
+#define GROUP_WINDOW 256
+
+// height of the bins (bands of rows) used by render_scene_parallel
+#define BIN_HEIGHT 64
+
+void init_scene(struct Scene *scene) {
+  memset(scene, 0, sizeof(*scene));
+}
+
+void free_scene(struct Scene *scene) {
+  free(scene->canvas.data);
+  for (int i = 0; i < NUM_IMAGE_SLOTS && scene->shared_images == NULL; i++) {
+    if (scene->image_mappings[i] != NULL) {
+      munmap(scene->image_mappings[i], scene->image_mapping_sizes[i]);
+    } else {
+      free(scene->images[i].data);
+    }
+    free_sprite_atlas(&scene->atlases[i]);
+  }
+  if (!scene->commands_mapped) {
+    free(scene->commands);
+  }
+  if (scene->mapping != NULL) {
+    munmap(scene->mapping, scene->mapping_size);
+  }
+  init_scene(scene);
+}
+
+void reset_scene(struct Scene *scene) {
+  struct Scene kept = *scene;
+
+  // keep the buffers from being freed
+  scene->canvas.data = NULL;
+  if (!scene->commands_mapped) {
+    scene->commands = NULL;
+  }
+  free_scene(scene);
+
+  scene->canvas.data = kept.canvas.data;
+  scene->canvas_capacity = kept.canvas_capacity;
+  if (!kept.commands_mapped) {
+    scene->commands = kept.commands;
+    scene->capacity = kept.capacity;
+  }
+  scene->use_atlases = kept.use_atlases;
+  scene->image_cache_dir = kept.image_cache_dir;
+  scene->shared_images = kept.shared_images;
+}
+
+int set_scene_size(struct Scene *scene, uint32_t width, uint32_t height) {
+  size_t num_pixels = (size_t) width * height;
+  if (!scene->parse_only && scene->canvas.data != NULL && scene->canvas_capacity >= num_pixels) {
+    // reuse the canvas, starting over from opaque black
+    for (size_t i = 0; i < num_pixels; i++) {
+      scene->canvas.data[i] = 0x000000FFU;
+    }
+    scene->canvas.width = width;
+    scene->canvas.height = height;
+  } else {
+    struct Image canvas = { .width = width, .height = height, .data = NULL };
+    if (!scene->parse_only) {
+      int rc = init_image(&canvas, width, height);
+      if (rc != IMG_SUCCESS) {
+        return rc;
+      }
+    }
+    free(scene->canvas.data);
+    scene->canvas = canvas;
+    scene->canvas_capacity = scene->parse_only ? 0 : num_pixels;
+  }
+  scene->has_canvas = 1;
+  scene->num_commands = 0;
+  return IMG_SUCCESS;
+}
+
+void init_shared_images(struct SharedImages *shared, const char *cache_dir) {
+  pthread_mutex_init(&shared->lock, NULL);
+  shared->cache_dir = cache_dir;
+  shared->images = NULL;
+  shared->num_images = 0;
+  shared->capacity = 0;
+}
+
+void free_shared_images(struct SharedImages *shared) {
+  for (size_t i = 0; i < shared->num_images; i++) {
+    struct SharedImage *entry = &shared->images[i];
+    if (entry->mapping != NULL) {
+      munmap(entry->mapping, entry->mapping_size);
+    } else {
+      free(entry->image.data);
+    }
+    free_sprite_atlas(&entry->atlas);
+  }
+  free(shared->images);
+  pthread_mutex_destroy(&shared->lock);
+}
+
+// find or load a shared image; called with the lock held
+static int find_shared_image(struct SharedImages *shared, const char *filename, int need_atlas,
+                             struct SharedImage **result) {
+  struct SharedImage *entry = NULL;
+  for (size_t i = 0; i < shared->num_images && entry == NULL; i++) {
+    if (strcmp(shared->images[i].filename, filename) == 0) {
+      entry = &shared->images[i];
+    }
+  }
+
+  if (entry == NULL) {
+    if (shared->num_images == shared->capacity) {
+      size_t capacity = shared->capacity ? shared->capacity * 2 : 8;
+      struct SharedImage *images = realloc(shared->images, capacity * sizeof(struct SharedImage));
+      if (images == NULL) {
+        return IMG_ERR_MALLOC_FAILED;
+      }
+      shared->images = images;
+      shared->capacity = capacity;
+    }
+    entry = &shared->images[shared->num_images];
+    memset(entry, 0, sizeof(*entry));
+    int rc = shared->cache_dir == NULL
+             ? read_image(filename, &entry->image)
+             : read_image_cached(shared->cache_dir, filename, &entry->image,
+                                 &entry->mapping, &entry->mapping_size);
+    if (rc != IMG_SUCCESS) {
+      return rc;
+    }
+    strcpy(entry->filename, filename);
+    shared->num_images++;
+  }
+
+  // atlases are built once too, rather than by every scene
+  if (need_atlas && entry->atlas.row_runs == NULL) {
+    int rc = init_sprite_atlas(&entry->atlas, &entry->image);
+    if (rc != IMG_SUCCESS) {
+      return rc;
+    }
+  }
+
+  *result = entry;
+  return IMG_SUCCESS;
+}
+
+int load_scene_image(struct Scene *scene, int slot, const char *filename) {
+  if (scene->shared_images != NULL) {
+    struct SharedImages *shared = scene->shared_images;
+    struct SharedImage *entry;
+    pthread_mutex_lock(&shared->lock);
+    int rc = find_shared_image(shared, filename, scene->use_atlases, &entry);
+    if (rc == IMG_SUCCESS) {
+      scene->images[slot] = entry->image;
+      scene->atlases[slot] = entry->atlas;
+    }
+    pthread_mutex_unlock(&shared->lock);
+    return rc;
+  }
+  if (scene->image_cache_dir == NULL) {
+    return read_image(filename, &scene->images[slot]);
+  }
+  return read_image_cached(scene->image_cache_dir, filename, &scene->images[slot],
+                           &scene->image_mappings[slot], &scene->image_mapping_sizes[slot]);
+}
+
+int add_command(struct Scene *scene, const struct Command *cmd) {
+  if (scene->num_commands >= scene->capacity) {
+    size_t capacity = scene->num_commands ? scene->num_commands * 2 : 64;
+    struct Command *commands;
+    if (scene->commands_mapped) {
+      // move the commands out of the mapped file so they can grow
+      commands = malloc(capacity * sizeof(struct Command));
+      if (commands != NULL) {
+        memcpy(commands, scene->commands, scene->num_commands * sizeof(struct Command));
+        scene->commands_mapped = 0;
+      }
+    } else {
+      commands = realloc(scene->commands, capacity * sizeof(struct Command));
+    }
+    if (commands == NULL) {
+      return IMG_ERR_MALLOC_FAILED;
+    }
+    scene->commands = commands;
+    scene->capacity = capacity;
+  }
+  scene->commands[scene->num_commands++] = *cmd;
+  return IMG_SUCCESS;
+}
+
+// clip the box [x0, x1) x [y0, y1) against the canvas
+static int clip_bounds(const struct Image *canvas, int64_t x0, int64_t y0, int64_t x1, int64_t y1,
+                       struct Rect *bounds) {
+  if (x0 < 0) {
+    x0 = 0;
+  }
+  if (y0 < 0) {
+    y0 = 0;
+  }
+  if (x1 > canvas->width) {
+    x1 = canvas->width;
+  }
+  if (y1 > canvas->height) {
+    y1 = canvas->height;
+  }
+  if (x1 <= x0 || y1 <= y0) {
+    return 0;
+  }
+  bounds->x = x0;
+  bounds->y = y0;
+  bounds->width = x1 - x0;
+  bounds->height = y1 - y0;
+  return 1;
+}
+
+int command_bounds(const struct Scene *scene, const struct Command *cmd, struct Rect *bounds) {
+  const struct Image *canvas = &scene->canvas;
+  int64_t x = cmd->x, y = cmd->y;
+
+  switch (cmd->type) {
+  case CMD_RECT:
+    return clip_bounds(canvas, cmd->rect.x, cmd->rect.y,
+                       (int64_t) cmd->rect.x + cmd->rect.width,
+                       (int64_t) cmd->rect.y + cmd->rect.height, bounds);
+
+  case CMD_CIRCLE: {
+    // a negative radius draws the same circle as its absolute value
+    int64_t r = cmd->r < 0 ? -(int64_t) cmd->r : cmd->r;
+    return clip_bounds(canvas, x - r, y - r, x + r + 1, y + r + 1, bounds);
+  }
+
+  case CMD_TILE:
+  case CMD_SPRITE:
+    // tiles and sprites that aren't inside their image draw nothing
+    if (!rect_in_img((struct Image *) &scene->images[cmd->slot], &cmd->rect)) {
+      return 0;
+    }
+    return clip_bounds(canvas, x, y, x + cmd->rect.width, y + cmd->rect.height, bounds);
+
+  default:
+    return 0;
+  }
+}
+
+// whether a command replaces every pixel in its bounds, regardless of
+// what was drawn there before
+static int is_opaque(const struct Command *cmd) {
+  return (cmd->type == CMD_RECT && (cmd->color & 0xFF) == 0xFF) || cmd->type == CMD_TILE;
+}
+
+static int rects_overlap(const struct Rect *a, const struct Rect *b) {
+  return a->x < b->x + b->width && b->x < a->x + a->width
+      && a->y < b->y + b->height && b->y < a->y + a->height;
+}
+
+// bitmap with one bit per canvas pixel, set for pixels that a later
+// opaque command overwrites
+struct Coverage {
+  uint64_t *bits;
+  size_t stride;   // words per row
+};
+
+// bits lo..hi-1 of a word (0 <= lo < hi <= 64)
+static uint64_t word_mask(uint32_t lo, uint32_t hi) {
+  uint64_t mask = hi == 64 ? ~UINT64_C(0) : (UINT64_C(1) << hi) - 1;
+  return mask & (~UINT64_C(0) << lo);
+}
+
+static int is_covered(const struct Coverage *cov, const struct Rect *r) {
+  uint32_t first = r->x / 64, last = (r->x + r->width - 1) / 64;
+  for (int32_t y = r->y; y < r->y + r->height; y++) {
+    const uint64_t *row = cov->bits + (size_t) y * cov->stride;
+    for (uint32_t w = first; w <= last; w++) {
+      uint64_t mask = word_mask(w == first ? r->x % 64 : 0,
+                                w == last ? (r->x + r->width - 1) % 64 + 1 : 64);
+      if ((row[w] & mask) != mask) {
+        return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+static void cover(struct Coverage *cov, const struct Rect *r) {
+  uint32_t first = r->x / 64, last = (r->x + r->width - 1) / 64;
+  for (int32_t y = r->y; y < r->y + r->height; y++) {
+    uint64_t *row = cov->bits + (size_t) y * cov->stride;
+    for (uint32_t w = first; w <= last; w++) {
+      row[w] |= word_mask(w == first ? r->x % 64 : 0,
+                          w == last ? (r->x + r->width - 1) % 64 + 1 : 64);
+    }
+  }
+}
+
+// drop commands that draw nothing or are completely overdrawn, walking
+// backwards so that the coverage map holds everything drawn later
+static int drop_hidden(struct Scene *scene) {
+  struct Coverage cov;
+  cov.stride = (scene->canvas.width + 63) / 64;
+  size_t num_words = cov.stride * scene->canvas.height;
+  cov.bits = calloc(num_words ? num_words : 1, sizeof(uint64_t));
+  uint8_t *keep = malloc(scene->num_commands);
+  if (cov.bits == NULL || keep == NULL) {
+    free(cov.bits);
+    free(keep);
+    return IMG_ERR_MALLOC_FAILED;
+  }
+
+  for (size_t i = scene->num_commands; i-- > 0; ) {
+    struct Command *cmd = &scene->commands[i];
+    struct Rect bounds;
+    keep[i] = command_bounds(scene, cmd, &bounds) && !is_covered(&cov, &bounds);
+    if (!keep[i]) {
+      continue;
+    }
+    if (cmd->type == CMD_RECT) {
+      // drawing the clipped rectangle is equivalent, and lets
+      // rectangles that hang off the canvas be merged
+      cmd->rect = bounds;
+    }
+    if (is_opaque(cmd)) {
+      cover(&cov, &bounds);
+    }
+  }
+
+  size_t n = 0;
+  for (size_t i = 0; i < scene->num_commands; i++) {
+    if (keep[i]) {
+      scene->commands[n++] = scene->commands[i];
+    }
+  }
+  scene->num_commands = n;
+
+  free(cov.bits);
+  free(keep);
+  return IMG_SUCCESS;
+}
+
+// merge rectangle b into a if they have the same color and together
+// form a rectangle; since they don't overlap, drawing the merged
+// rectangle is the same as drawing both
+static int merge_rects(struct Command *a, const struct Command *b) {
+  if (a->type != CMD_RECT || b->type != CMD_RECT || a->color != b->color) {
+    return 0;
+  }
+  struct Rect *ra = &a->rect;
+  const struct Rect *rb = &b->rect;
+  if (ra->y == rb->y && ra->height == rb->height
+      && (ra->x + ra->width == rb->x || rb->x + rb->width == ra->x)) {
+    ra->x = ra->x < rb->x ? ra->x : rb->x;
+    ra->width += rb->width;
+    return 1;
+  }
+  if (ra->x == rb->x && ra->width == rb->width
+      && (ra->y + ra->height == rb->y || rb->y + rb->height == ra->y)) {
+    ra->y = ra->y < rb->y ? ra->y : rb->y;
+    ra->height += rb->height;
+    return 1;
+  }
+  return 0;
+}
+
+// reorder a window of consecutive tile commands so that tiles from the
+// same image are drawn together; a tile only moves ahead of earlier
+// tiles it doesn't overlap, so the result is unchanged
+static void group_tiles(const struct Scene *scene, struct Command *cmds, size_t n) {
+  struct Command grouped[GROUP_WINDOW];
+  struct Rect bounds[GROUP_WINDOW];
+  uint8_t done[GROUP_WINDOW];
+
+  for (size_t i = 0; i < n; i++) {
+    command_bounds(scene, &cmds[i], &bounds[i]);
+    done[i] = 0;
+  }
+
+  size_t out = 0, first = 0;
+  while (out < n) {
+    while (done[first]) {
+      first++;
+    }
+    uint8_t slot = cmds[first].slot;
+    for (size_t i = first; i < n; i++) {
+      if (done[i] || cmds[i].slot != slot) {
+        continue;
+      }
+      int blocked = 0;
+      for (size_t j = first; j < i && !blocked; j++) {
+        blocked = !done[j] && rects_overlap(&bounds[i], &bounds[j]);
+      }
+      if (!blocked) {
+        grouped[out++] = cmds[i];
+        done[i] = 1;
+      }
+    }
+  }
+  memcpy(cmds, grouped, n * sizeof(struct Command));
+}
+
+int optimize_scene(struct Scene *scene) {
+  int rc = drop_hidden(scene);
+  if (rc != IMG_SUCCESS) {
+    return rc;
+  }
+
+  // every remaining rectangle is clipped to the canvas, so merging
+  // can't overflow
+  size_t n = 0;
+  for (size_t i = 0; i < scene->num_commands; i++) {
+    if (n > 0 && merge_rects(&scene->commands[n - 1], &scene->commands[i])) {
+      continue;
+    }
+    scene->commands[n++] = scene->commands[i];
+  }
+  scene->num_commands = n;
+
+  for (size_t i = 0; i < n; ) {
+    size_t end = i;
+    while (end < n && end - i < GROUP_WINDOW && scene->commands[end].type == CMD_TILE) {
+      end++;
+    }
+    if (end - i > 1) {
+      group_tiles(scene, scene->commands + i, end - i);
+    }
+    i = end > i ? end : i + 1;
+  }
+  return IMG_SUCCESS;
+}
+
+void draw_command(const struct Scene *scene, struct Image *canvas, const struct Command *cmd) {
+  // the drawing functions don't modify the tilemap/spritemap
+  struct Image *image = (struct Image *) &scene->images[cmd->slot];
+
+  switch (cmd->type) {
+  case CMD_RECT:
+    draw_rect(canvas, &cmd->rect, cmd->color);
+    break;
+  case CMD_CIRCLE:
+    draw_circle(canvas, cmd->x, cmd->y, cmd->r, cmd->color);
+    break;
+  case CMD_TILE:
+    draw_tile(canvas, cmd->x, cmd->y, image, &cmd->rect);
+    break;
+  case CMD_SPRITE:
+    if (scene->use_atlases) {
+      draw_sprite_premul(canvas, cmd->x, cmd->y, &scene->atlases[cmd->slot], &cmd->rect);
+    } else {
+      draw_sprite(canvas, cmd->x, cmd->y, image, &cmd->rect);
+    }
+    break;
+  }
+}
+
+// build atlases for the images that are used as spritemaps, so that
+// rendering never has to
+static int prepare_atlases(struct Scene *scene) {
+  if (!scene->use_atlases) {
+    return IMG_SUCCESS;
+  }
+  for (size_t i = 0; i < scene->num_commands; i++) {
+    const struct Command *cmd = &scene->commands[i];
+    if (cmd->type == CMD_SPRITE && scene->atlases[cmd->slot].row_runs == NULL) {
+      int rc = init_sprite_atlas(&scene->atlases[cmd->slot], &scene->images[cmd->slot]);
+      if (rc != IMG_SUCCESS) {
+        return rc;
+      }
+    }
+  }
+  return IMG_SUCCESS;
+}
+
+int render_scene(struct Scene *scene) {
+  int rc = prepare_atlases(scene);
+  if (rc != IMG_SUCCESS) {
+    return rc;
+  }
+
+  for (size_t i = 0; i < scene->num_commands; i++) {
+    draw_command(scene, &scene->canvas, &scene->commands[i]);
+  }
+  scene->num_commands = 0;
+  return IMG_SUCCESS;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Parallel rendering
+////////////////////////////////////////////////////////////////////////
+
+// The canvas is split into bins of BIN_HEIGHT full-width rows, so each
+// bin is itself an Image (just offset into the canvas data). A pixel
+// only depends on the commands that touch it, in order, so rendering
+// each bin's commands in order gives exactly the serial result.
+struct BinJobs {
+  const struct Scene *scene;
+  uint32_t num_bins;
+  uint32_t *bin_start;   // commands of bin b are bin_cmds[bin_start[b]] .. bin_cmds[bin_start[b+1]-1]
+  uint32_t *bin_cmds;
+  uint32_t next_bin;     // next bin to render (shared by the workers)
+};
+
+// move a command up by y0 rows, so that it draws the same pixels
+// into a bin whose first row is canvas row y0; returns 0 if the
+// moved command's coordinates don't fit in 32 bits
+static int translate_command(const struct Command *cmd, const struct Rect *bounds, int32_t y0,
+                             struct Command *out) {
+  *out = *cmd;
+  if (cmd->type == CMD_RECT) {
+    // only the clipped rectangle matters
+    out->rect = *bounds;
+    out->rect.y -= y0;
+    return 1;
+  }
+  int64_t y = (int64_t) cmd->y - y0;
+  out->y = y;
+  return y == out->y;
+}
+
+static void render_bin(struct BinJobs *jobs, uint32_t bin) {
+  const struct Scene *scene = jobs->scene;
+  int32_t y0 = bin * BIN_HEIGHT;
+  uint32_t height = scene->canvas.height - y0 < BIN_HEIGHT ? scene->canvas.height - y0 : BIN_HEIGHT;
+  struct Image view = {
+    .width = scene->canvas.width,
+    .height = height,
+    .data = scene->canvas.data + (size_t) y0 * scene->canvas.width,
+  };
+
+  for (uint32_t i = jobs->bin_start[bin]; i < jobs->bin_start[bin + 1]; i++) {
+    const struct Command *cmd = &scene->commands[jobs->bin_cmds[i]];
+    struct Rect bounds;
+    struct Command moved;
+    command_bounds(scene, cmd, &bounds);
+    translate_command(cmd, &bounds, y0, &moved);
+    draw_command(scene, &view, &moved);
+  }
+}
+
+static void *render_worker(void *arg) {
+  struct BinJobs *jobs = arg;
+  for (;;) {
+    uint32_t bin = __atomic_fetch_add(&jobs->next_bin, 1, __ATOMIC_RELAXED);
+    if (bin >= jobs->num_bins) {
+      return NULL;
+    }
+    render_bin(jobs, bin);
+  }
+}
+
+// record which commands touch each bin
+static int bin_commands(struct BinJobs *jobs) {
+  const struct Scene *scene = jobs->scene;
+  jobs->bin_start = calloc(jobs->num_bins + 1, sizeof(uint32_t));
+  if (jobs->bin_start == NULL) {
+    return IMG_ERR_MALLOC_FAILED;
+  }
+
+  // count the commands in each bin, then turn the counts into offsets
+  for (size_t i = 0; i < scene->num_commands; i++) {
+    struct Rect bounds;
+    struct Command moved;
+    if (!command_bounds(scene, &scene->commands[i], &bounds)) {
+      continue;
+    }
+    uint32_t first = bounds.y / BIN_HEIGHT, last = (bounds.y + bounds.height - 1) / BIN_HEIGHT;
+    for (uint32_t b = first; b <= last; b++) {
+      if (!translate_command(&scene->commands[i], &bounds, b * BIN_HEIGHT, &moved)) {
+        return IMG_ERR_NOT_BINNABLE;
+      }
+      jobs->bin_start[b + 1]++;
+    }
+  }
+  for (uint32_t b = 0; b < jobs->num_bins; b++) {
+    jobs->bin_start[b + 1] += jobs->bin_start[b];
+  }
+
+  jobs->bin_cmds = malloc(((size_t) jobs->bin_start[jobs->num_bins] + 1) * sizeof(uint32_t));
+  uint32_t *fill = malloc(((size_t) jobs->num_bins + 1) * sizeof(uint32_t));
+  if (jobs->bin_cmds == NULL || fill == NULL) {
+    free(fill);
+    return IMG_ERR_MALLOC_FAILED;
+  }
+  memcpy(fill, jobs->bin_start, jobs->num_bins * sizeof(uint32_t));
+  for (size_t i = 0; i < scene->num_commands; i++) {
+    struct Rect bounds;
+    if (!command_bounds(scene, &scene->commands[i], &bounds)) {
+      continue;
+    }
+    uint32_t first = bounds.y / BIN_HEIGHT, last = (bounds.y + bounds.height - 1) / BIN_HEIGHT;
+    for (uint32_t b = first; b <= last; b++) {
+      jobs->bin_cmds[fill[b]++] = i;
+    }
+  }
+  free(fill);
+  return IMG_SUCCESS;
+}
+
+int render_scene_parallel(struct Scene *scene, int num_threads) {
+  int rc = prepare_atlases(scene);
+  if (rc != IMG_SUCCESS) {
+    return rc;
+  }
+
+  struct BinJobs jobs = {
+    .scene = scene,
+    .num_bins = (scene->canvas.height + BIN_HEIGHT - 1) / BIN_HEIGHT,
+    .bin_start = NULL,
+    .bin_cmds = NULL,
+    .next_bin = 0,
+  };
+  if (num_threads <= 1 || jobs.num_bins <= 1 || scene->num_commands > UINT32_MAX) {
+    return render_scene(scene);
+  }
+
+  rc = bin_commands(&jobs);
+  if (rc != IMG_SUCCESS) {
+    free(jobs.bin_start);
+    free(jobs.bin_cmds);
+    // some command can't be expressed relative to a bin, or there
+    // isn't memory for the bins; either way the scene can still be
+    // rendered serially
+    return render_scene(scene);
+  }
+
+  if ((uint32_t) num_threads > jobs.num_bins) {
+    num_threads = jobs.num_bins;
+  }
+  // this thread is one of the num_threads workers
+  pthread_t *threads = malloc((num_threads - 1) * sizeof(pthread_t));
+  int num_started = 0;
+  if (threads != NULL) {
+    while (num_started < num_threads - 1
+           && pthread_create(&threads[num_started], NULL, render_worker, &jobs) == 0) {
+      num_started++;
+    }
+  }
+  // this thread renders whatever the workers don't get to, so it's
+  // fine if some (or all) of them couldn't be started
+  render_worker(&jobs);
+  for (int i = 0; i < num_started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  free(threads);
+  free(jobs.bin_start);
+  free(jobs.bin_cmds);
+  scene->num_commands = 0;
+  return IMG_SUCCESS;
+}
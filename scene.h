@@ -0,0 +1,193 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "image.h"
+#include "drawing_funcs.h"
+#include "sprite_atlas.h"
+
+#define NUM_IMAGE_SLOTS 8
+
+// command types (the same letters used in the input files)
+#define CMD_RECT    'R'
+#define CMD_CIRCLE  'C'
+#define CMD_TILE    'T'
+#define CMD_SPRITE  'P'
+
+// one buffered drawing command
+struct Command {
+  uint8_t type;      // one of the CMD_* values
+  uint8_t slot;      // T, P: image slot
+  uint32_t color;    // R, C: color
+  int32_t x, y;      // C: center; T, P: destination
+  int32_t r;         // C: radius
+  struct Rect rect;  // R: rectangle; T, P: tile/sprite within the image
+};
+
+// an image loaded once and shared by many scenes
+struct SharedImage {
+  char filename[256];
+  struct Image image;
+  struct SpriteAtlas atlas;   // built if the image was loaded for a scene that uses atlases
+  void *mapping;              // cache file mapping holding the pixels, if any
+  size_t mapping_size;
+};
+
+// The images loaded by a group of scenes (such as a batch rendered by
+// several threads). Scenes that point to it load each file only once,
+// and never free the images themselves.
+struct SharedImages {
+  pthread_mutex_t lock;
+  const char *cache_dir;   // load images through this cache, if not NULL
+  struct SharedImage *images;
+  size_t num_images;
+  size_t capacity;
+};
+
+// A parsed scene: the canvas, the loaded images, and the drawing
+// commands that haven't been rendered yet.
+struct Scene {
+  struct Image canvas;
+  size_t canvas_capacity;   // pixels allocated for the canvas
+  int has_canvas;    // an S command has been seen
+  struct Image images[NUM_IMAGE_SLOTS];
+  char filenames[NUM_IMAGE_SLOTS][256];   // "" for slots with no image
+  struct SpriteAtlas atlases[NUM_IMAGE_SLOTS];
+  void *image_mappings[NUM_IMAGE_SLOTS];   // cache file mapping holding
+  size_t image_mapping_sizes[NUM_IMAGE_SLOTS];  // an image's pixels, if any
+  const char *image_cache_dir;   // load images through this cache (see image_cache.h)
+  struct SharedImages *shared_images;   // load images from here instead, if not NULL
+  int use_atlases;   // draw sprites with draw_sprite_premul
+  int parse_only;    // only record the canvas size and image filenames
+  struct Command *commands;
+  size_t num_commands;
+  size_t capacity;
+  int commands_mapped;   // commands point into mapping rather than the heap
+  void *mapping;         // mapped scene file (see scene_file.h), if any
+  size_t mapping_size;
+};
+
+// Initialize an empty scene with no canvas.
+//
+// Parameters:
+//   scene - pointer to Scene to initialize
+void init_scene(struct Scene *scene);
+
+// Free the canvas, images, atlases and commands owned by a scene.
+//
+// Parameters:
+//   scene - pointer to Scene to clean up
+void free_scene(struct Scene *scene);
+
+// Empty a scene so it can be used for another one. This is like
+// free_scene followed by init_scene, except that the canvas and
+// command buffers are kept for reuse, as are the settings
+// use_atlases, image_cache_dir and shared_images.
+//
+// Parameters:
+//   scene - pointer to Scene to reset
+void reset_scene(struct Scene *scene);
+
+// Initialize an empty set of shared images.
+//
+// Parameters:
+//   shared    - pointer to SharedImages to initialize
+//   cache_dir - image cache directory (see image_cache.h), or NULL
+void init_shared_images(struct SharedImages *shared, const char *cache_dir);
+
+// Free the images (and atlases) in a set of shared images. No scene
+// may still be using them.
+//
+// Parameters:
+//   shared - pointer to SharedImages to clean up
+void free_shared_images(struct SharedImages *shared);
+
+// (Re)create the canvas, discarding any buffered commands, since
+// they could only have drawn on the old canvas. The canvas buffer is
+// reused if it's big enough. If the scene is parse_only, just the
+// size is recorded.
+//
+// Returns:
+//   IMG_SUCCESS if successful, otherwise one of the
+//   IMG_ERR_* values
+int set_scene_size(struct Scene *scene, uint32_t width, uint32_t height);
+
+// Load the PNG file for an image slot, from the scene's shared images
+// or through its image cache if it has them.
+//
+// Parameters:
+//   scene    - pointer to Scene
+//   slot     - image slot to load into (which must be empty)
+//   filename - name of the PNG file
+//
+// Returns:
+//   IMG_SUCCESS if successful, otherwise one of the
+//   IMG_ERR_* values
+int load_scene_image(struct Scene *scene, int slot, const char *filename);
+
+// Append a command to the scene's command buffer.
+//
+// Returns:
+//   IMG_SUCCESS if successful, otherwise one of the
+//   IMG_ERR_* values
+int add_command(struct Scene *scene, const struct Command *cmd);
+
+// Compute the region of the canvas a command can change.
+//
+// Parameters:
+//   scene  - pointer to Scene (for the canvas and image sizes)
+//   cmd    - pointer to the Command
+//   bounds - set to the (clipped) bounding box of the command
+//
+// Returns:
+//   1 if the command can change at least one pixel, 0 if it draws nothing
+int command_bounds(const struct Scene *scene, const struct Command *cmd, struct Rect *bounds);
+
+// Rewrite the command buffer so that it renders the same image with
+// less work:
+//   - commands that draw nothing, or whose pixels are all overwritten
+//     by later opaque rectangles and tiles, are dropped
+//   - adjacent rectangles of the same color are merged
+//   - runs of tiles are grouped by image slot where reordering them
+//     can't change the result
+//
+// Parameters:
+//   scene - pointer to Scene
+//
+// Returns:
+//   IMG_SUCCESS if successful, otherwise one of the
+//   IMG_ERR_* values
+int optimize_scene(struct Scene *scene);
+
+// Draw one command onto a canvas.
+//
+// Parameters:
+//   scene  - pointer to Scene (for the images and atlases)
+//   canvas - pointer to Image to draw on
+//   cmd    - pointer to the Command
+void draw_command(const struct Scene *scene, struct Image *canvas, const struct Command *cmd);
+
+// Draw all buffered commands onto the scene's canvas and empty the
+// command buffer.
+//
+// Returns:
+//   IMG_SUCCESS if successful, otherwise one of the
+//   IMG_ERR_* values
+int render_scene(struct Scene *scene);
+
+// Like render_scene, but splits the canvas into bins of rows and
+// renders them on num_threads threads. The result is identical to
+// render_scene.
+//
+// Parameters:
+//   scene       - pointer to Scene
+//   num_threads - number of threads to render with
+//
+// Returns:
+//   IMG_SUCCESS if successful, otherwise one of the
+//   IMG_ERR_* values
+int render_scene_parallel(struct Scene *scene, int num_threads);
+
+#endif // SCENE_H
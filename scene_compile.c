@@ -0,0 +1,46 @@
+// Compile a scene script (the .in format read by c_draw) into a
+// binary scene file that c_draw -b can map and render directly.
+
+#include <stdio.h>
+#include <unistd.h>
+#include "image.h"
+#include "scene.h"
+#include "parser.h"
+#include "scene_file.h"
+
+int main(int argc, char **argv) {
+  if (argc != 3) {
+    fprintf(stderr, "Usage: scene_compile <input.in> <output scene file>\n");
+    return 1;
+  }
+
+  FILE *in = fopen(argv[1], "r");
+  if (in == NULL) {
+    fprintf(stderr, "Error: could not open input file\n");
+    return 1;
+  }
+
+  struct Scene scene;
+  init_scene(&scene);
+  // images are only loaded when the compiled scene is rendered
+  scene.parse_only = 1;
+
+  int error = 0;
+  struct Input input;
+  if (read_input(fileno(in), &input) != IMG_SUCCESS) {
+    error = 1;
+    fprintf(stderr, "Error: could not read input\n");
+  } else {
+    error = parse_scene(input.data, input.size, &scene);
+    free_input(&input);
+  }
+  fclose(in);
+
+  if (!error && write_scene_file(argv[2], &scene) != IMG_SUCCESS) {
+    error = 1;
+    fprintf(stderr, "Error: could not write scene file\n");
+  }
+
+  free_scene(&scene);
+  return error;
+}
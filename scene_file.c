@@ -0,0 +1,231 @@
+// Reading and writing compiled scene files
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "scene_file.h"
+
+// records are used in place on little-endian hosts, which relies on
+// struct Command having exactly the record layout
+_Static_assert(sizeof(struct Command) == SCENE_FILE_RECORD_SIZE, "struct Command size");
+_Static_assert(offsetof(struct Command, color) == 4, "struct Command layout");
+_Static_assert(offsetof(struct Command, rect) == 20, "struct Command layout");
+
+static const char scene_magic[4] = { 'C', 'S', 'F', 'S' };
+
+static void put_u32(uint8_t *p, uint32_t val) {
+  p[0] = val;
+  p[1] = val >> 8;
+  p[2] = val >> 16;
+  p[3] = val >> 24;
+}
+
+static uint32_t get_u32(const uint8_t *p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static void encode_command(uint8_t *p, const struct Command *cmd) {
+  memset(p, 0, SCENE_FILE_RECORD_SIZE);
+  p[0] = cmd->type;
+  p[1] = cmd->slot;
+  put_u32(p + 4, cmd->color);
+  put_u32(p + 8, cmd->x);
+  put_u32(p + 12, cmd->y);
+  put_u32(p + 16, cmd->r);
+  put_u32(p + 20, cmd->rect.x);
+  put_u32(p + 24, cmd->rect.y);
+  put_u32(p + 28, cmd->rect.width);
+  put_u32(p + 32, cmd->rect.height);
+}
+
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+static void decode_command(const uint8_t *p, struct Command *cmd) {
+  cmd->type = p[0];
+  cmd->slot = p[1];
+  cmd->color = get_u32(p + 4);
+  cmd->x = get_u32(p + 8);
+  cmd->y = get_u32(p + 12);
+  cmd->r = get_u32(p + 16);
+  cmd->rect.x = get_u32(p + 20);
+  cmd->rect.y = get_u32(p + 24);
+  cmd->rect.width = get_u32(p + 28);
+  cmd->rect.height = get_u32(p + 32);
+}
+#endif
+
+int write_scene_file(const char *filename, const struct Scene *scene) {
+  uint8_t header[SCENE_FILE_HEADER_SIZE] = { 0 };
+  uint32_t strings_size = 0;
+
+  memcpy(header, scene_magic, 4);
+  put_u32(header + 4, SCENE_FILE_VERSION);
+  put_u32(header + 8, scene->has_canvas ? SCENE_FILE_HAS_CANVAS : 0);
+  put_u32(header + 12, scene->canvas.width);
+  put_u32(header + 16, scene->canvas.height);
+  put_u32(header + 20, scene->num_commands);
+  for (int i = 0; i < NUM_IMAGE_SLOTS; i++) {
+    if (scene->filenames[i][0] == '\0') {
+      put_u32(header + 28 + 4 * i, SCENE_FILE_NO_IMAGE);
+    } else {
+      put_u32(header + 28 + 4 * i, strings_size);
+      strings_size += strlen(scene->filenames[i]) + 1;
+    }
+  }
+  put_u32(header + 24, strings_size);
+
+  FILE *out = fopen(filename, "wb");
+  if (out == NULL) {
+    return IMG_ERR_COULD_NOT_OPEN;
+  }
+  int ok = fwrite(header, sizeof(header), 1, out) == 1;
+  uint8_t record[SCENE_FILE_RECORD_SIZE];
+  for (size_t i = 0; ok && i < scene->num_commands; i++) {
+    encode_command(record, &scene->commands[i]);
+    ok = fwrite(record, sizeof(record), 1, out) == 1;
+  }
+  for (int i = 0; ok && i < NUM_IMAGE_SLOTS; i++) {
+    if (scene->filenames[i][0] != '\0') {
+      ok = fwrite(scene->filenames[i], strlen(scene->filenames[i]) + 1, 1, out) == 1;
+    }
+  }
+  if (fclose(out) != 0) {
+    ok = 0;
+  }
+  return ok ? IMG_SUCCESS : IMG_ERR_COULD_NOT_WRITE;
+}
+
+// check everything that rendering relies on, so that a corrupt file
+// can't make the drawing functions read out of bounds
+static int validate_scene_file(const uint8_t *data, size_t size) {
+  if (size < SCENE_FILE_HEADER_SIZE || memcmp(data, scene_magic, 4) != 0
+      || get_u32(data + 4) != SCENE_FILE_VERSION) {
+    return 0;
+  }
+  uint64_t num_commands = get_u32(data + 20);
+  uint64_t strings_size = get_u32(data + 24);
+  uint64_t strings_start = SCENE_FILE_HEADER_SIZE + num_commands * SCENE_FILE_RECORD_SIZE;
+  if (strings_start + strings_size != size || get_u32(data + 60) != 0) {
+    return 0;
+  }
+  // like a script, a scene can't draw before it has a canvas
+  if (num_commands > 0 && !(get_u32(data + 8) & SCENE_FILE_HAS_CANVAS)) {
+    return 0;
+  }
+
+  const char *strings = (const char *) data + strings_start;
+  for (int i = 0; i < NUM_IMAGE_SLOTS; i++) {
+    uint32_t offset = get_u32(data + 28 + 4 * i);
+    if (offset == SCENE_FILE_NO_IMAGE) {
+      continue;
+    }
+    if (offset >= strings_size) {
+      return 0;
+    }
+    size_t len = strnlen(strings + offset, strings_size - offset);
+    if (len == 0 || len >= 256 || offset + len == strings_size) {
+      return 0;
+    }
+  }
+
+  for (uint64_t i = 0; i < num_commands; i++) {
+    const uint8_t *record = data + SCENE_FILE_HEADER_SIZE + i * SCENE_FILE_RECORD_SIZE;
+    if (record[2] != 0 || record[3] != 0) {
+      return 0;
+    }
+    switch (record[0]) {
+    case CMD_RECT:
+    case CMD_CIRCLE:
+      // draw_command takes the address of the slot's image even for
+      // commands that don't draw one
+      if (record[1] != 0) {
+        return 0;
+      }
+      break;
+    case CMD_TILE:
+    case CMD_SPRITE:
+      if (record[1] >= NUM_IMAGE_SLOTS || get_u32(data + 28 + 4 * record[1]) == SCENE_FILE_NO_IMAGE) {
+        return 0;
+      }
+      break;
+    default:
+      return 0;
+    }
+  }
+  return 1;
+}
+
+int read_scene_file(const char *filename, struct Scene *scene) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    return IMG_ERR_COULD_NOT_OPEN;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return IMG_ERR_COULD_NOT_OPEN;
+  }
+  if (st.st_size < SCENE_FILE_HEADER_SIZE) {
+    close(fd);
+    return SCENE_ERR_INVALID_FILE;
+  }
+  // a private writable mapping, so that optimize_scene can rewrite
+  // the commands in place without touching the file
+  void *mapping = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    return IMG_ERR_COULD_NOT_OPEN;
+  }
+  scene->mapping = mapping;
+  scene->mapping_size = st.st_size;
+
+  const uint8_t *data = mapping;
+  if (!validate_scene_file(data, st.st_size)) {
+    return SCENE_ERR_INVALID_FILE;
+  }
+
+  uint32_t num_commands = get_u32(data + 20);
+  const char *strings = (const char *) data + SCENE_FILE_HEADER_SIZE
+                        + (size_t) num_commands * SCENE_FILE_RECORD_SIZE;
+  for (int i = 0; i < NUM_IMAGE_SLOTS; i++) {
+    uint32_t offset = get_u32(data + 28 + 4 * i);
+    if (offset == SCENE_FILE_NO_IMAGE) {
+      continue;
+    }
+    strcpy(scene->filenames[i], strings + offset);
+    if (load_scene_image(scene, i, scene->filenames[i]) != IMG_SUCCESS) {
+      return SCENE_ERR_BAD_IMAGE;
+    }
+  }
+
+  if (get_u32(data + 8) & SCENE_FILE_HAS_CANVAS) {
+    int rc = set_scene_size(scene, get_u32(data + 12), get_u32(data + 16));
+    if (rc != IMG_SUCCESS) {
+      return rc;
+    }
+  }
+
+  struct Command *commands = (struct Command *) (data + SCENE_FILE_HEADER_SIZE);
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+  // decode the records into the same memory (each record is
+  // decoded before it's overwritten)
+  for (uint32_t i = 0; i < num_commands; i++) {
+    struct Command cmd;
+    decode_command((const uint8_t *) &commands[i], &cmd);
+    commands[i] = cmd;
+  }
+#endif
+  // a reset scene may still have a command buffer
+  if (!scene->commands_mapped) {
+    free(scene->commands);
+  }
+  scene->commands = commands;
+  scene->num_commands = num_commands;
+  scene->capacity = num_commands;
+  scene->commands_mapped = 1;
+  return IMG_SUCCESS;
+}
@@ -0,0 +1,62 @@
+#ifndef SCENE_FILE_H
+#define SCENE_FILE_H
+
+#include "scene.h"
+
+// Compiled scene files hold a scene's commands in a form that can be
+// mapped and used directly. All values are little-endian.
+//
+//   offset  size  contents
+//   0       4     magic "CSFS"
+//   4       4     format version (SCENE_FILE_VERSION)
+//   8       4     flags (SCENE_FILE_HAS_CANVAS)
+//   12      4     canvas width
+//   16      4     canvas height
+//   20      4     number of commands
+//   24      4     size of the string table
+//   28      32    for each image slot, the offset of its filename in
+//                 the string table, or SCENE_FILE_NO_IMAGE
+//   60      4     reserved (0)
+//   64      36*n  command records (see below)
+//   ...           string table: NUL-terminated filenames
+//
+// Each command record has the same layout as struct Command:
+//   0 type, 1 slot, 2-3 reserved (0), 4 color, 8 x, 12 y, 16 r,
+//   20 rect.x, 24 rect.y, 28 rect.width, 32 rect.height
+#define SCENE_FILE_VERSION      1
+#define SCENE_FILE_HEADER_SIZE  64
+#define SCENE_FILE_RECORD_SIZE  36
+#define SCENE_FILE_HAS_CANVAS   1
+#define SCENE_FILE_NO_IMAGE     0xFFFFFFFFU
+
+// return values from read_scene_file, besides the IMG_* values
+#define SCENE_ERR_INVALID_FILE  -10
+#define SCENE_ERR_BAD_IMAGE     -11
+
+// Write a parsed scene (typically parse_only) to a compiled scene file.
+//
+// Parameters:
+//   filename - name of the file to write
+//   scene    - pointer to Scene
+//
+// Returns:
+//   IMG_SUCCESS if successful, otherwise one of the
+//   IMG_ERR_* values
+int write_scene_file(const char *filename, const struct Scene *scene);
+
+// Map a compiled scene file into a freshly initialized scene: the
+// canvas is created, the images are loaded, and the commands are
+// used in place from the mapping.
+//
+// Parameters:
+//   filename - name of the file to read
+//   scene    - pointer to Scene
+//
+// Returns:
+//   IMG_SUCCESS if successful, IMG_ERR_COULD_NOT_OPEN if the file
+//   couldn't be opened, SCENE_ERR_INVALID_FILE if it isn't a valid
+//   scene file, SCENE_ERR_BAD_IMAGE if an image couldn't be loaded,
+//   or IMG_ERR_MALLOC_FAILED
+int read_scene_file(const char *filename, struct Scene *scene);
+
+#endif // SCENE_FILE_H
@@ -0,0 +1,150 @@
+// Premultiplied sprite atlases with per-row run metadata
+
+#include <stdlib.h>
+#include <string.h>
+#include "blend.h"
+#include "sprite_atlas.h"
+
+static uint32_t pixel_kind(uint32_t color) {
+	switch (color & 0xFF) {
+	case 0:
+		return SPRITE_RUN_TRANSPARENT;
+	case 0xFF:
+		return SPRITE_RUN_OPAQUE;
+	default:
+		return SPRITE_RUN_BLEND;
+	}
+}
+
+// split one row into runs; returns the number of runs, and stores
+// them in runs if it isn't NULL
+static uint32_t find_runs(const uint32_t *row, uint32_t width, struct SpriteRun *runs) {
+	uint32_t count = 0;
+	uint32_t i = 0;
+	while (i < width) {
+		uint32_t kind = pixel_kind(row[i]);
+		uint32_t start = i;
+		while (i < width && pixel_kind(row[i]) == kind) {
+			i++;
+		}
+		if (runs != NULL) {
+			runs[count].start = start;
+			runs[count].length = i - start;
+			runs[count].kind = kind;
+		}
+		count++;
+	}
+	return count;
+}
+
+int init_sprite_atlas(struct SpriteAtlas *atlas, const struct Image *img) {
+	size_t num_pixels = (size_t) img->width * img->height;
+
+	// count the runs first so they can go in one allocation
+	size_t num_runs = 0;
+	for (uint32_t y = 0; y < img->height; y++) {
+		num_runs += find_runs(img->data + (size_t) y * img->width, img->width, NULL);
+	}
+
+	uint64_t *premul = malloc(num_pixels * sizeof(uint64_t));
+	struct SpriteRun *runs = malloc(num_runs * sizeof(struct SpriteRun));
+	uint32_t *row_runs = malloc((img->height + 1) * sizeof(uint32_t));
+	if ((premul == NULL && num_pixels > 0) || (runs == NULL && num_runs > 0) || row_runs == NULL) {
+		free(premul);
+		free(runs);
+		free(row_runs);
+		return IMG_ERR_MALLOC_FAILED;
+	}
+
+	for (size_t i = 0; i < num_pixels; i++) {
+		premul[i] = premultiply_pixel(img->data[i]);
+	}
+
+	uint32_t run = 0;
+	for (uint32_t y = 0; y < img->height; y++) {
+		row_runs[y] = run;
+		run += find_runs(img->data + (size_t) y * img->width, img->width, runs + run);
+	}
+	row_runs[img->height] = run;
+
+	atlas->width = img->width;
+	atlas->height = img->height;
+	atlas->pixels = img->data;
+	atlas->premul = premul;
+	atlas->runs = runs;
+	atlas->row_runs = row_runs;
+	return IMG_SUCCESS;
+}
+
+void free_sprite_atlas(struct SpriteAtlas *atlas) {
+	free(atlas->premul);
+	free(atlas->runs);
+	free(atlas->row_runs);
+	atlas->premul = NULL;
+	atlas->runs = NULL;
+	atlas->row_runs = NULL;
+}
+
+// index of the run in row y that contains column x
+static uint32_t find_run(const struct SpriteAtlas *atlas, uint32_t y, uint32_t x) {
+	uint32_t lo = atlas->row_runs[y];
+	uint32_t hi = atlas->row_runs[y + 1] - 1;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo + 1) / 2;
+		if (atlas->runs[mid].start <= x) {
+			lo = mid;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	return lo;
+}
+
+void draw_sprite_premul(struct Image *img,
+                        int32_t x, int32_t y,
+                        const struct SpriteAtlas *atlas,
+                        const struct Rect *sprite) {
+	// same acceptance and clipping rules as draw_sprite
+	struct Image bounds = { atlas->width, atlas->height, (uint32_t *) atlas->pixels };
+	if (!rect_in_img(&bounds, sprite)) {
+		return;
+	}
+	struct Rect dest = { .x = x, .y = y, .width = sprite->width, .height = sprite->height };
+	struct Rect clipped;
+	if (!clip_rect(img, &dest, &clipped)) {
+		return;
+	}
+	uint32_t src_x = sprite->x + ((int64_t) clipped.x - x);
+	uint32_t src_y = sprite->y + ((int64_t) clipped.y - y);
+	uint32_t src_end = src_x + clipped.width;
+
+	for (int32_t j = 0; j < clipped.height; j++) {
+		uint32_t row = src_y + j;
+		size_t row_start = (size_t) row * atlas->width;
+		uint32_t *dst = img->data + (size_t) (clipped.y + j) * img->width + clipped.x;
+
+		uint32_t last_run = atlas->row_runs[row + 1];
+		for (uint32_t r = find_run(atlas, row, src_x); r < last_run; r++) {
+			const struct SpriteRun *run = &atlas->runs[r];
+			if (run->start >= src_end) {
+				break;
+			}
+			uint32_t lo = run->start > src_x ? run->start : src_x;
+			uint32_t hi = run->start + run->length < src_end ? run->start + run->length : src_end;
+			uint32_t *out = dst + (lo - src_x);
+
+			switch (run->kind) {
+			case SPRITE_RUN_TRANSPARENT:
+				// colors are untouched, but the blend still makes dst opaque
+				blend_fill(out, 0, hi - lo);
+				break;
+			case SPRITE_RUN_OPAQUE:
+				memcpy(out, atlas->pixels + row_start + lo, (hi - lo) * sizeof(uint32_t));
+				break;
+			default:
+				blend_span_premul(out, atlas->premul + row_start + lo, hi - lo);
+				break;
+			}
+		}
+	}
+}
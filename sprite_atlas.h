@@ -0,0 +1,65 @@
+#ifndef SPRITE_ATLAS_H
+#define SPRITE_ATLAS_H
+
+#include <stdint.h>
+#include "image.h"
+#include "drawing_funcs.h"
+
+// kinds of runs of pixels within an atlas row
+#define SPRITE_RUN_TRANSPARENT  0
+#define SPRITE_RUN_OPAQUE       1
+#define SPRITE_RUN_BLEND        2
+
+// a maximal run of pixels in one row that all have the same kind
+struct SpriteRun {
+  uint32_t start;
+  uint32_t length;
+  uint32_t kind;
+};
+
+// A spritemap converted for fast sprite drawing: every pixel is stored
+// premultiplied (see premultiply_pixel in blend.h), and each row is
+// split into runs that are fully transparent (skipped), fully opaque
+// (copied from the original pixels), or need blending.
+struct SpriteAtlas {
+  uint32_t width;
+  uint32_t height;
+  const uint32_t *pixels; // the source image's pixels (not owned)
+  uint64_t *premul;
+  struct SpriteRun *runs;
+  uint32_t *row_runs; // runs of row y are runs[row_runs[y]] .. runs[row_runs[y+1]-1]
+};
+
+// Build a sprite atlas from a loaded spritemap. The atlas refers to
+// the image's pixel data, so the image must outlive the atlas.
+//
+// Parameters:
+//   atlas - pointer to SpriteAtlas to initialize
+//   img - pointer to the spritemap image
+//
+// Returns:
+//   IMG_SUCCESS if successful, otherwise one of the
+//   IMG_ERR_* values
+int init_sprite_atlas(struct SpriteAtlas *atlas, const struct Image *img);
+
+// Free the memory owned by a sprite atlas.
+//
+// Parameters:
+//   atlas - pointer to SpriteAtlas to clean up
+void free_sprite_atlas(struct SpriteAtlas *atlas);
+
+// Draw a sprite from an atlas. Produces exactly the same pixels as
+// draw_sprite on the atlas's source image.
+//
+// Parameters:
+//   img    - pointer to Image (dest image)
+//   x      - x coordinate of location where sprite should be copied
+//   y      - y coordinate of location where sprite should be copied
+//   atlas  - pointer to SpriteAtlas
+//   sprite - pointer to Rect (the sprite)
+void draw_sprite_premul(struct Image *img,
+                        int32_t x, int32_t y,
+                        const struct SpriteAtlas *atlas,
+                        const struct Rect *sprite);
+
+#endif // SPRITE_ATLAS_H
@@ -3,8 +3,23 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "pnglite.h"
 #include "image.h"
 #include "drawing_funcs.h"
+#include "blend.h"
+#include "sprite_atlas.h"
+#include "scene.h"
+#include "parser.h"
+#include "scene_file.h"
+#include "image_cache.h"
+#include "image_formats.h"
+#include "batch.h"
 #include "tctest.h"
 // TODO: add prototypes for your helper functions
 
@@ -87,6 +102,7 @@ void test_draw_circle2(TestObjs *objs);
 void test_draw_circle3(TestObjs *objs);
 
 void test_draw_circle_clip(TestObjs *objs);
+void test_draw_circle_offscreen(TestObjs *objs);
 void test_draw_tile(TestObjs *objs);
 void test_draw_sprite(TestObjs *objs);
 
@@ -107,12 +123,40 @@ void test_set_a(TestObjs *objs);
 void test_blend_color(TestObjs *objs);
 void test_make_color(TestObjs *objs);
 void test_blend_colors(TestObjs *objs);
+void test_blend_span(TestObjs *objs);
+void test_blend_fill(TestObjs *objs);
+void test_blend_span_runs(TestObjs *objs);
+void test_blend_span_premul(TestObjs *objs);
 void test_set_pixel(TestObjs *objs);
 void test_square(TestObjs *objs);
 void test_square_dist(TestObjs *objs);
+void test_isqrt(TestObjs *objs);
 void test_is_in_circle(TestObjs *objs);
 void test_is_in_range(TestObjs *objs);
 void test_is_in_rect(TestObjs *objs);
+void test_clip_rect(TestObjs *objs);
+void test_rect_in_img(TestObjs *objs);
+void test_draw_tile_clip(TestObjs *objs);
+void test_draw_sprite_premul(TestObjs *objs);
+void test_optimize_scene(TestObjs *objs);
+void test_optimize_scene_random(TestObjs *objs);
+void test_render_scene_parallel(TestObjs *objs);
+void test_parse_scene(TestObjs *objs);
+void test_scene_file(TestObjs *objs);
+void test_write_image(TestObjs *objs);
+void test_write_image_filters(TestObjs *objs);
+void test_read_image_rgb(TestObjs *objs);
+void test_png_open_mem_read(TestObjs *objs);
+void test_png_write_begin_error(TestObjs *objs);
+void test_png_get_rgba(TestObjs *objs);
+void test_read_image_truncated(TestObjs *objs);
+void test_read_image_cached(TestObjs *objs);
+void test_render_batch(TestObjs *objs);
+void test_write_image_opaque(TestObjs *objs);
+void test_write_image_palette(TestObjs *objs);
+void test_write_image_threads(TestObjs *objs);
+void test_image_formats(TestObjs *objs);
+void test_write_raw_frame(TestObjs *objs);
 
 int main(int argc, char **argv) {
   if (argc > 1) {
@@ -129,8 +173,30 @@ int main(int argc, char **argv) {
 	TEST(test_draw_circle2);
 	TEST(test_draw_circle3);
   TEST(test_draw_circle_clip);
+  TEST(test_draw_circle_offscreen);
   TEST(test_draw_tile);
+  TEST(test_draw_tile_clip);
   TEST(test_draw_sprite);
+  TEST(test_draw_sprite_premul);
+  TEST(test_optimize_scene);
+  TEST(test_optimize_scene_random);
+  TEST(test_render_scene_parallel);
+  TEST(test_parse_scene);
+  TEST(test_scene_file);
+  TEST(test_write_image);
+  TEST(test_write_image_filters);
+  TEST(test_read_image_rgb);
+  TEST(test_write_image_opaque);
+  TEST(test_write_image_palette);
+  TEST(test_write_image_threads);
+  TEST(test_image_formats);
+  TEST(test_png_open_mem_read);
+  TEST(test_png_write_begin_error);
+  TEST(test_png_get_rgba);
+  TEST(test_read_image_truncated);
+  TEST(test_read_image_cached);
+  TEST(test_render_batch);
+  TEST(test_write_raw_frame);
 
   // TEST(test_set_Nth_bit);
   // TEST(test_get_Nth_bit);
@@ -148,12 +214,19 @@ int main(int argc, char **argv) {
   TEST(test_blend_color);
   TEST(test_make_color);
   TEST(test_blend_colors);
+  TEST(test_blend_span);
+  TEST(test_blend_fill);
+  TEST(test_blend_span_runs);
+  TEST(test_blend_span_premul);
   TEST(test_set_pixel);
   TEST(test_square);
   TEST(test_square_dist);
+  TEST(test_isqrt);
   TEST(test_is_in_circle);
   TEST(test_is_in_range);
   TEST(test_is_in_rect);
+  TEST(test_clip_rect);
+  TEST(test_rect_in_img);
 
   TEST_FINI();
 }
@@ -253,6 +326,25 @@ void test_draw_circle_clip(TestObjs *objs) {
   check_picture(&objs->small, &expected);
 }
 
+void test_draw_circle_offscreen(TestObjs *objs) {
+  Picture expected = {
+    { {' ', 0x000000FF}, {'x', 0x00FF00FF} },
+    "        "
+    "        "
+    "        "
+    "x       "
+    "xxxxxx  "
+    "xxxxxxxx"
+  };
+
+  // center well below the image, only the top of the circle is visible
+  draw_circle(&objs->small, 0, 20, 17, 0x00FF00FF);
+  // a huge circle whose center is far off to the right covers nothing
+  draw_circle(&objs->small, 3000000, 2, 2999990, 0x00FF00FF);
+
+  check_picture(&objs->small, &expected);
+}
+
 void test_draw_tile(TestObjs *objs) {
   ASSERT(read_image("img/PrtMimi.png", &objs->tilemap) == IMG_SUCCESS);
 
@@ -668,6 +760,127 @@ void test_blend_colors(TestObjs *objs) {
 	ASSERT(blend_colors(0x43110b1f, 0xe1121100) == 0xcd1110ff);
 }
 
+// pseudo-random pixel values for the span tests, covering
+// opaque, transparent and partially transparent colors
+static uint32_t test_pixel(uint32_t i) {
+  uint32_t color = i * 2654435761U;
+  switch (i % 4) {
+  case 0: return color | 0xFF;
+  case 1: return color & ~0xFFU;
+  default: return color;
+  }
+}
+
+void test_blend_span(TestObjs *objs) {
+  uint32_t src[67], dst[67], expected[67];
+  int saved_kernel = blend_get_kernel();
+
+  for (int kernel = BLEND_KERNEL_SCALAR; kernel <= BLEND_KERNEL_AVX2; kernel++) {
+    if (blend_set_kernel(kernel) != kernel) {
+      continue; // not supported on this CPU
+    }
+    // every length up to 67 exercises the vector loops and their tails
+    for (uint32_t n = 0; n <= 67; n++) {
+      for (uint32_t i = 0; i < n; i++) {
+        src[i] = test_pixel(i + n);
+        dst[i] = test_pixel(i * 7 + 3);
+        expected[i] = blend_colors(src[i], dst[i]);
+      }
+      blend_span(dst, src, n);
+      for (uint32_t i = 0; i < n; i++) {
+        ASSERT(dst[i] == expected[i]);
+      }
+    }
+  }
+
+  blend_set_kernel(saved_kernel);
+}
+
+void test_blend_fill(TestObjs *objs) {
+  uint32_t colors[] = { 0x00FF0080, 0x12345601, 0xABCDEFFE, 0xFF0000FF, 0x10203000 };
+  uint32_t dst[67], expected[67];
+  int saved_kernel = blend_get_kernel();
+
+  for (int kernel = BLEND_KERNEL_SCALAR; kernel <= BLEND_KERNEL_AVX2; kernel++) {
+    if (blend_set_kernel(kernel) != kernel) {
+      continue; // not supported on this CPU
+    }
+    for (unsigned c = 0; c < sizeof(colors) / sizeof(colors[0]); c++) {
+      for (uint32_t n = 0; n <= 67; n++) {
+        for (uint32_t i = 0; i < n; i++) {
+          dst[i] = test_pixel(i * 5 + n);
+          expected[i] = blend_colors(colors[c], dst[i]);
+        }
+        blend_fill(dst, colors[c], n);
+        for (uint32_t i = 0; i < n; i++) {
+          ASSERT(dst[i] == expected[i]);
+        }
+      }
+    }
+  }
+
+  blend_set_kernel(saved_kernel);
+}
+
+void test_blend_span_runs(TestObjs *objs) {
+  uint32_t src[64], dst[64], expected[64];
+  int saved_kernel = blend_get_kernel();
+
+  // long runs of opaque and fully transparent pixels take the copy
+  // and skip paths, with a few translucent pixels in between
+  for (uint32_t i = 0; i < 64; i++) {
+    src[i] = test_pixel(i);
+    if (i < 24) {
+      src[i] |= 0xFF;
+    } else if (i < 48) {
+      src[i] &= ~0xFFU;
+    }
+  }
+  src[30] = 0x11223380;
+
+  for (int kernel = BLEND_KERNEL_SCALAR; kernel <= BLEND_KERNEL_AVX2; kernel++) {
+    if (blend_set_kernel(kernel) != kernel) {
+      continue; // not supported on this CPU
+    }
+    for (uint32_t i = 0; i < 64; i++) {
+      dst[i] = test_pixel(i * 3 + 1);
+      expected[i] = blend_colors(src[i], dst[i]);
+    }
+    blend_span(dst, src, 64);
+    for (uint32_t i = 0; i < 64; i++) {
+      ASSERT(dst[i] == expected[i]);
+    }
+  }
+
+  blend_set_kernel(saved_kernel);
+}
+
+void test_blend_span_premul(TestObjs *objs) {
+  uint32_t dst[67], expected[67];
+  uint64_t src[67];
+  int saved_kernel = blend_get_kernel();
+
+  for (int kernel = BLEND_KERNEL_SCALAR; kernel <= BLEND_KERNEL_AVX2; kernel++) {
+    if (blend_set_kernel(kernel) != kernel) {
+      continue; // not supported on this CPU
+    }
+    for (uint32_t n = 0; n <= 67; n++) {
+      for (uint32_t i = 0; i < n; i++) {
+        uint32_t color = test_pixel(i * 11 + n);
+        src[i] = premultiply_pixel(color);
+        dst[i] = test_pixel(i * 7 + 3);
+        expected[i] = blend_colors(color, dst[i]);
+      }
+      blend_span_premul(dst, src, n);
+      for (uint32_t i = 0; i < n; i++) {
+        ASSERT(dst[i] == expected[i]);
+      }
+    }
+  }
+
+  blend_set_kernel(saved_kernel);
+}
+
 void test_make_color(TestObjs *objs){
   ASSERT(make_color(0xff, 0x34, 0xfe) == 0xff34feff);
 }
@@ -713,6 +926,21 @@ void test_square_dist(TestObjs *objs){
 	ASSERT(square_dist(3, 2, 3, 0)==4);
 }
 
+void test_isqrt(TestObjs *objs){
+  ASSERT(isqrt(-4) == 0);
+  ASSERT(isqrt(0) == 0);
+  ASSERT(isqrt(1) == 1);
+  ASSERT(isqrt(3) == 1);
+  ASSERT(isqrt(4) == 2);
+  ASSERT(isqrt(24) == 4);
+  ASSERT(isqrt(25) == 5);
+  ASSERT(isqrt(26) == 5);
+  // perfect squares near the top of the range where doubles round
+  ASSERT(isqrt(4611686014132420609LL) == 2147483647LL);
+  ASSERT(isqrt(4611686014132420608LL) == 2147483646LL);
+  ASSERT(isqrt(4611686018427387904LL) == 2147483648LL);
+}
+
 void test_is_in_circle(TestObjs *objs){
   ASSERT(is_in_circle(&objs->small, 3, 2, 0, 0, 2) == 0);
   ASSERT(is_in_circle(&objs->small, 3, 2, 1, 0, 2) == 0);
@@ -805,4 +1033,1074 @@ void test_is_in_rect(TestObjs *objs){
   ASSERT(is_in_rect(&(objs->small), &r, 3, 5) == 0);
   ASSERT(is_in_rect(&(objs->small), &r, 4, 5) == 0);
   ASSERT(is_in_rect(&(objs->small), &r, 5, 5) == 0);
-}
\ No newline at end of file
+}
+
+void test_clip_rect(TestObjs *objs){
+  struct Rect clipped;
+
+  // entirely inside the image
+  struct Rect inside = { .x = 2, .y = 1, .width = 3, .height = 4 };
+  ASSERT(clip_rect(&objs->small, &inside, &clipped) == 1);
+  ASSERT(clipped.x == 2 && clipped.y == 1 && clipped.width == 3 && clipped.height == 4);
+
+  // hanging off the top left corner
+  struct Rect top_left = { .x = -2, .y = -3, .width = 5, .height = 5 };
+  ASSERT(clip_rect(&objs->small, &top_left, &clipped) == 1);
+  ASSERT(clipped.x == 0 && clipped.y == 0 && clipped.width == 3 && clipped.height == 2);
+
+  // hanging off the bottom right corner
+  struct Rect bottom_right = { .x = 6, .y = 4, .width = 10, .height = 10 };
+  ASSERT(clip_rect(&objs->small, &bottom_right, &clipped) == 1);
+  ASSERT(clipped.x == 6 && clipped.y == 4 && clipped.width == 2 && clipped.height == 2);
+
+  // larger than the image on every side
+  struct Rect cover = { .x = -1, .y = -1, .width = 100, .height = 100 };
+  ASSERT(clip_rect(&objs->small, &cover, &clipped) == 1);
+  ASSERT(clipped.x == 0 && clipped.y == 0 && clipped.width == SMALL_W && clipped.height == SMALL_H);
+
+  // completely outside, or empty
+  struct Rect right = { .x = SMALL_W, .y = 0, .width = 3, .height = 3 };
+  struct Rect above = { .x = 0, .y = -3, .width = 3, .height = 3 };
+  struct Rect empty = { .x = 1, .y = 1, .width = 0, .height = 3 };
+  struct Rect negative = { .x = 4, .y = 1, .width = -2, .height = 3 };
+  struct Rect huge = { .x = 2147483600, .y = 0, .width = 2147483600, .height = 3 };
+  ASSERT(clip_rect(&objs->small, &right, &clipped) == 0);
+  ASSERT(clip_rect(&objs->small, &above, &clipped) == 0);
+  ASSERT(clip_rect(&objs->small, &empty, &clipped) == 0);
+  ASSERT(clip_rect(&objs->small, &negative, &clipped) == 0);
+  ASSERT(clip_rect(&objs->small, &huge, &clipped) == 0);
+}
+
+void test_rect_in_img(TestObjs *objs){
+  struct Rect whole = { .x = 0, .y = 0, .width = SMALL_W, .height = SMALL_H };
+  struct Rect inside = { .x = 2, .y = 1, .width = 3, .height = 4 };
+  struct Rect corner = { .x = SMALL_W - 1, .y = SMALL_H - 1, .width = 1, .height = 1 };
+  ASSERT(rect_in_img(&objs->small, &whole) == 1);
+  ASSERT(rect_in_img(&objs->small, &inside) == 1);
+  ASSERT(rect_in_img(&objs->small, &corner) == 1);
+
+  struct Rect left = { .x = -1, .y = 0, .width = 3, .height = 3 };
+  struct Rect above = { .x = 0, .y = -1, .width = 3, .height = 3 };
+  struct Rect too_wide = { .x = 6, .y = 0, .width = 3, .height = 3 };
+  struct Rect too_tall = { .x = 0, .y = 4, .width = 3, .height = 3 };
+  ASSERT(rect_in_img(&objs->small, &left) == 0);
+  ASSERT(rect_in_img(&objs->small, &above) == 0);
+  ASSERT(rect_in_img(&objs->small, &too_wide) == 0);
+  ASSERT(rect_in_img(&objs->small, &too_tall) == 0);
+}
+
+void test_draw_tile_clip(TestObjs *objs) {
+  struct Image tilemap;
+  ASSERT(init_image(&tilemap, 4, 3) == IMG_SUCCESS);
+  for (uint32_t i = 0; i < 12; i++) {
+    tilemap.data[i] = 0x10101000U * i + 0x80; // tile pixels are copied, alpha and all
+  }
+
+  // hangs off the left and bottom edges of the destination
+  struct Rect tile = { .x = 1, .y = 0, .width = 3, .height = 3 };
+  draw_tile(&objs->small, -1, 4, &tilemap, &tile);
+  // not entirely inside the tilemap, so nothing is drawn
+  struct Rect outside = { .x = 2, .y = 1, .width = 3, .height = 2 };
+  draw_tile(&objs->small, 4, 0, &tilemap, &outside);
+
+  Picture expected = {
+    {
+      { ' ', 0x000000FF },
+      { 'a', 0x20202080 },
+      { 'b', 0x30303080 },
+      { 'c', 0x60606080 },
+      { 'd', 0x70707080 },
+    },
+    "        "
+    "        "
+    "        "
+    "        "
+    "ab      "
+    "cd      "
+  };
+
+  check_picture(&objs->small, &expected);
+  free(tilemap.data);
+}
+
+void test_draw_sprite_premul(TestObjs *objs) {
+  ASSERT(read_image("img/NpcGuest.png", &objs->spritemap) == IMG_SUCCESS);
+  struct SpriteAtlas atlas;
+  ASSERT(init_sprite_atlas(&atlas, &objs->spritemap) == IMG_SUCCESS);
+
+  struct Image expected;
+  ASSERT(init_image(&expected, LARGE_W, LARGE_H) == IMG_SUCCESS);
+
+  // must match draw_sprite exactly, including when clipped and when
+  // the sprite isn't entirely inside the spritemap
+  struct Rect sprites[] = {
+    { .x = 128, .y = 136, .width = 16, .height = 15 },
+    { .x = 0, .y = 0, .width = 24, .height = 20 },
+    { .x = 35, .y = 70, .width = 21, .height = 17 },
+    { .x = 200, .y = 100, .width = 100, .height = 10 },
+  };
+  int32_t positions[][2] = { { 4, 2 }, { -5, -3 }, { 15, 12 }, { -30, 0 }, { 24, 0 } };
+
+  for (unsigned s = 0; s < sizeof(sprites) / sizeof(sprites[0]); s++) {
+    for (unsigned p = 0; p < sizeof(positions) / sizeof(positions[0]); p++) {
+      for (uint32_t i = 0; i < LARGE_W * LARGE_H; i++) {
+        objs->large.data[i] = expected.data[i] = test_pixel(i);
+      }
+      draw_sprite(&expected, positions[p][0], positions[p][1], &objs->spritemap, &sprites[s]);
+      draw_sprite_premul(&objs->large, positions[p][0], positions[p][1], &atlas, &sprites[s]);
+      ASSERT(memcmp(objs->large.data, expected.data, LARGE_W * LARGE_H * sizeof(uint32_t)) == 0);
+    }
+  }
+
+  free(expected.data);
+  free_sprite_atlas(&atlas);
+}
+
+void test_optimize_scene(TestObjs *objs) {
+  struct Scene scene;
+  init_scene(&scene);
+  ASSERT(set_scene_size(&scene, 40, 30) == IMG_SUCCESS);
+
+  struct Command cmds[] = {
+    // hidden under the opaque rectangle at the end
+    { .type = CMD_CIRCLE, .x = 10, .y = 10, .r = 3, .color = 0x11223344 },
+    // entirely off the canvas
+    { .type = CMD_RECT, .rect = { 50, 0, 5, 5 }, .color = 0x112233FF },
+    // two halves of one rectangle, the second hanging off the canvas
+    { .type = CMD_RECT, .rect = { 20, 20, 10, 5 }, .color = 0x44556680 },
+    { .type = CMD_RECT, .rect = { 30, 20, 100, 5 }, .color = 0x44556680 },
+    { .type = CMD_RECT, .rect = { 0, 0, 20, 20 }, .color = 0x778899FF },
+  };
+  for (unsigned i = 0; i < sizeof(cmds) / sizeof(cmds[0]); i++) {
+    ASSERT(add_command(&scene, &cmds[i]) == IMG_SUCCESS);
+  }
+
+  ASSERT(optimize_scene(&scene) == IMG_SUCCESS);
+  ASSERT(scene.num_commands == 2);
+  ASSERT(scene.commands[0].type == CMD_RECT);
+  ASSERT(scene.commands[0].rect.x == 20 && scene.commands[0].rect.width == 20);
+  ASSERT(scene.commands[0].rect.y == 20 && scene.commands[0].rect.height == 5);
+  ASSERT(scene.commands[1].rect.x == 0 && scene.commands[1].rect.width == 20);
+
+  free_scene(&scene);
+}
+
+// append pseudo-random commands to a scene whose image slots 0 and 1
+// hold PrtMimi.png and NpcGuest.png
+static void add_random_commands(struct Scene *scene, uint32_t seed, int count) {
+  uint32_t w = scene->canvas.width, h = scene->canvas.height;
+  for (int i = 0; i < count; i++) {
+    struct Command cmd = { 0 };
+    uint32_t v[8];
+    for (int j = 0; j < 8; j++) {
+      seed = seed * 1103515245 + 12345;
+      v[j] = seed >> 8;
+    }
+    switch (v[0] % 4) {
+    case 0:
+      cmd.type = CMD_RECT;
+      // snap to a grid so that rectangles line up and can be merged
+      cmd.rect.x = (int32_t) (v[1] % (w / 8 + 3)) * 8 - 8;
+      cmd.rect.y = (int32_t) (v[2] % (h / 8 + 3)) * 8 - 8;
+      cmd.rect.width = v[3] % 3 * 8;
+      cmd.rect.height = v[4] % 3 * 8;
+      cmd.color = (v[5] % 3 * 0x40302000) | (v[6] % 2 ? 0xFF : v[7] & 0xFF);
+      break;
+    case 1:
+      cmd.type = CMD_CIRCLE;
+      cmd.x = (int32_t) (v[1] % (w + 23)) - 10;
+      cmd.y = (int32_t) (v[2] % (h + 19)) - 10;
+      cmd.r = (int32_t) (v[3] % 20) - 2;
+      cmd.color = v[4];
+      break;
+    default:
+      cmd.type = v[0] % 4 == 2 ? CMD_TILE : CMD_SPRITE;
+      cmd.slot = v[1] % 2;
+      cmd.rect.x = v[2] % 16 * 16;
+      cmd.rect.y = v[3] % 12 * 16;
+      cmd.rect.width = 16;
+      cmd.rect.height = 16;
+      cmd.x = (int32_t) (v[4] % (w / 12 + 1)) * 12 - 12;
+      cmd.y = (int32_t) (v[5] % (h / 12 + 2)) * 12 - 12;
+      break;
+    }
+    ASSERT(add_command(scene, &cmd) == IMG_SUCCESS);
+  }
+}
+
+// optimizing a random scene mustn't change the rendered image
+void test_optimize_scene_random(TestObjs *objs) {
+  struct Scene scene;
+  init_scene(&scene);
+  ASSERT(set_scene_size(&scene, 97, 61) == IMG_SUCCESS);
+  ASSERT(read_image("img/PrtMimi.png", &scene.images[0]) == IMG_SUCCESS);
+  ASSERT(read_image("img/NpcGuest.png", &scene.images[1]) == IMG_SUCCESS);
+
+  add_random_commands(&scene, 12345, 2000);
+
+  struct Image expected;
+  ASSERT(init_image(&expected, 97, 61) == IMG_SUCCESS);
+  for (size_t i = 0; i < scene.num_commands; i++) {
+    draw_command(&scene, &expected, &scene.commands[i]);
+  }
+
+  size_t num_commands = scene.num_commands;
+  ASSERT(optimize_scene(&scene) == IMG_SUCCESS);
+  ASSERT(scene.num_commands < num_commands);
+  ASSERT(render_scene(&scene) == IMG_SUCCESS);
+  ASSERT(memcmp(scene.canvas.data, expected.data, 97 * 61 * sizeof(uint32_t)) == 0);
+
+  free(expected.data);
+  free_scene(&scene);
+}
+
+// rendering in parallel must give exactly the same image
+void test_render_scene_parallel(TestObjs *objs) {
+  struct Scene serial, parallel;
+  init_scene(&serial);
+  init_scene(&parallel);
+  // tall enough for several bins, with a partial one at the bottom
+  ASSERT(set_scene_size(&serial, 97, 300) == IMG_SUCCESS);
+  ASSERT(set_scene_size(&parallel, 97, 300) == IMG_SUCCESS);
+  ASSERT(read_image("img/PrtMimi.png", &serial.images[0]) == IMG_SUCCESS);
+  ASSERT(read_image("img/NpcGuest.png", &serial.images[1]) == IMG_SUCCESS);
+  ASSERT(read_image("img/PrtMimi.png", &parallel.images[0]) == IMG_SUCCESS);
+  ASSERT(read_image("img/NpcGuest.png", &parallel.images[1]) == IMG_SUCCESS);
+
+  add_random_commands(&serial, 777, 3000);
+  add_random_commands(&parallel, 777, 3000);
+  // a big circle that touches every bin
+  struct Command circle = { .type = CMD_CIRCLE, .x = 40, .y = 150, .r = 170, .color = 0x20406080 };
+  ASSERT(add_command(&serial, &circle) == IMG_SUCCESS);
+  ASSERT(add_command(&parallel, &circle) == IMG_SUCCESS);
+
+  ASSERT(render_scene(&serial) == IMG_SUCCESS);
+  ASSERT(render_scene_parallel(&parallel, 3) == IMG_SUCCESS);
+  ASSERT(parallel.num_commands == 0);
+  ASSERT(memcmp(serial.canvas.data, parallel.canvas.data, 97 * 300 * sizeof(uint32_t)) == 0);
+
+  free_scene(&serial);
+  free_scene(&parallel);
+}
+
+void test_parse_scene(TestObjs *objs) {
+  // not NUL-terminated, and commands may span lines
+  const char script[] = "S 40 30\nL 1 img/NpcGuest.png\n"
+                        "R -1 +2 3 4 0xFF0000fF C 5\n6 -7 80808080\n"
+                        "P 1 0 0 16 16 -3 4\nT 1 2 3 4 5 6 7 R 1 1 1 1 0x";
+  struct Scene scene;
+  init_scene(&scene);
+  ASSERT(parse_scene(script, sizeof(script) - 1, &scene) == 0);
+  ASSERT(scene.canvas.width == 40 && scene.canvas.height == 30);
+  ASSERT(scene.images[1].data != NULL);
+  ASSERT(scene.num_commands == 5);
+
+  const struct Command *cmds = scene.commands;
+  ASSERT(cmds[0].type == CMD_RECT && cmds[0].rect.x == -1 && cmds[0].rect.y == 2);
+  ASSERT(cmds[0].rect.width == 3 && cmds[0].rect.height == 4 && cmds[0].color == 0xFF0000FF);
+  ASSERT(cmds[1].type == CMD_CIRCLE && cmds[1].x == 5 && cmds[1].y == 6);
+  ASSERT(cmds[1].r == -7 && cmds[1].color == 0x80808080);
+  ASSERT(cmds[2].type == CMD_SPRITE && cmds[2].slot == 1 && cmds[2].x == -3 && cmds[2].y == 4);
+  ASSERT(cmds[3].type == CMD_TILE && cmds[3].rect.x == 2 && cmds[3].rect.height == 5);
+  ASSERT(cmds[4].type == CMD_RECT && cmds[4].color == 0);
+  free_scene(&scene);
+
+  // errors stop parsing
+  init_scene(&scene);
+  ASSERT(parse_scene("S 4 4 R 1 2 3", 13, &scene) == 1);
+  free_scene(&scene);
+  init_scene(&scene);
+  ASSERT(parse_scene("R 1 2 3 4 ff", 12, &scene) == 1);
+  free_scene(&scene);
+}
+
+// Each run of the tests keeps its files in a directory of its own,
+// so runs at the same time (e.g. the c_ and asm_ tests) don't clobber
+// each other's files. The tests remove their files, and the directory
+// is removed when the run ends.
+#define TEST_PATH_MAX 256
+
+static char test_dir[] = "/tmp/test_drawing_funcs.XXXXXX";
+static int test_dir_created = 0;
+
+static void remove_test_dir(void) {
+  rmdir(test_dir);
+}
+
+// put the name of a file in this run's directory in path (which has
+// room for TEST_PATH_MAX bytes), and return path
+static char *test_path(char *path, const char *name) {
+  if (!test_dir_created) {
+    ASSERT(mkdtemp(test_dir) != NULL);
+    test_dir_created = 1;
+    atexit(remove_test_dir);
+  }
+  ASSERT(snprintf(path, TEST_PATH_MAX, "%s/%s", test_dir, name) < TEST_PATH_MAX);
+  return path;
+}
+
+static long file_size(const char *filename) {
+  FILE *f = fopen(filename, "rb");
+  if (f == NULL) {
+    return -1;
+  }
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fclose(f);
+  return size;
+}
+
+// read a whole file written by a test
+static uint8_t *read_test_file(const char *filename, size_t *size) {
+  long n = file_size(filename);
+  ASSERT(n >= 0);
+  uint8_t *data = malloc(n + 1);
+  FILE *f = fopen(filename, "rb");
+  ASSERT(data != NULL && f != NULL);
+  ASSERT(fread(data, 1, n, f) == (size_t) n);
+  fclose(f);
+  *size = n;
+  return data;
+}
+
+// find the first chunk of a type in a PNG file's contents; returns
+// its offset (the offset of its length field)
+static size_t find_png_chunk(const uint8_t *data, size_t size, const char *type) {
+  size_t pos = 8;
+  while (pos + 12 <= size && memcmp(data + pos + 4, type, 4) != 0) {
+    pos += 12 + (((size_t) data[pos] << 24) | (data[pos + 1] << 16) | (data[pos + 2] << 8) | data[pos + 3]);
+  }
+  ASSERT(pos + 12 <= size);
+  return pos;
+}
+
+// write a file with the given contents
+static void write_test_data(const char *filename, const void *data, size_t size) {
+  FILE *f = fopen(filename, "wb");
+  ASSERT(f != NULL && fwrite(data, 1, size, f) == size);
+  fclose(f);
+}
+
+void test_scene_file(TestObjs *objs) {
+  const char script[] = "L 3 img/NpcGuest.png S 40 30\n"
+                        "R 1 2 3 4 ff0000ff\nC 5 6 -7 80808080\nP 3 0 0 16 16 -3 4\n";
+  char filename[TEST_PATH_MAX];
+  test_path(filename, "test_scene_file.scn");
+
+  struct Scene compiled;
+  init_scene(&compiled);
+  compiled.parse_only = 1;
+  ASSERT(parse_scene(script, sizeof(script) - 1, &compiled) == 0);
+  ASSERT(compiled.canvas.data == NULL && compiled.images[3].data == NULL);
+  ASSERT(write_scene_file(filename, &compiled) == IMG_SUCCESS);
+
+  struct Scene scene;
+  init_scene(&scene);
+  ASSERT(read_scene_file(filename, &scene) == IMG_SUCCESS);
+  ASSERT(scene.has_canvas && scene.canvas.width == 40 && scene.canvas.height == 30);
+  ASSERT(scene.canvas.data != NULL);
+  ASSERT(scene.images[3].data != NULL && strcmp(scene.filenames[3], "img/NpcGuest.png") == 0);
+  ASSERT(scene.images[0].data == NULL && scene.filenames[0][0] == '\0');
+  ASSERT(scene.num_commands == 3);
+  ASSERT(memcmp(scene.commands, compiled.commands, 3 * sizeof(struct Command)) == 0);
+
+  // the mapped commands can still be added to
+  struct Command cmd = { .type = CMD_RECT, .rect = { 0, 0, 1, 1 }, .color = 0xFF };
+  ASSERT(add_command(&scene, &cmd) == IMG_SUCCESS);
+  ASSERT(scene.num_commands == 4 && scene.commands[1].r == -7);
+
+  free_scene(&scene);
+  free_scene(&compiled);
+
+  // files that could make rendering misbehave are rejected: a slot
+  // on a command that doesn't draw an image, nonzero reserved bytes
+  // in a record or in the header, and commands without a canvas
+  const size_t offsets[] = { SCENE_FILE_HEADER_SIZE + 1, SCENE_FILE_HEADER_SIZE + 36 + 1,
+                             SCENE_FILE_HEADER_SIZE + 72 + 2, SCENE_FILE_HEADER_SIZE + 3, 60, 8 };
+  const uint8_t values[] = { 3, 3, 1, 1, 1, 0 };
+  size_t size;
+  uint8_t *data = read_test_file(filename, &size);
+  for (unsigned i = 0; i < sizeof(offsets) / sizeof(offsets[0]); i++) {
+    uint8_t orig = data[offsets[i]];
+    data[offsets[i]] = values[i];
+    write_test_data(filename, data, size);
+    data[offsets[i]] = orig;
+    init_scene(&scene);
+    ASSERT(read_scene_file(filename, &scene) == SCENE_ERR_INVALID_FILE);
+    free_scene(&scene);
+  }
+  free(data);
+  remove(filename);
+}
+
+void test_write_image(TestObjs *objs) {
+  // big enough to need several IDAT chunks
+  struct Image img, loaded;
+  ASSERT(init_image(&img, 300, 200) == IMG_SUCCESS);
+  for (uint32_t i = 0; i < 300 * 200; i++) {
+    img.data[i] = test_pixel(i);
+  }
+  char filename[TEST_PATH_MAX];
+  test_path(filename, "test_write_image.png");
+  ASSERT(write_image(filename, &img) == IMG_SUCCESS);
+  ASSERT(read_image(filename, &loaded) == IMG_SUCCESS);
+  ASSERT(loaded.width == 300 && loaded.height == 200);
+  ASSERT(memcmp(loaded.data, img.data, 300 * 200 * sizeof(uint32_t)) == 0);
+
+  free(img.data);
+  free(loaded.data);
+  remove(filename);
+}
+
+void test_write_image_filters(TestObjs *objs) {
+  // odd widths leave partial blocks at the ends of rows for the
+  // vectorized filters; the gradients favor every filter type
+  // somewhere, and the noise makes the rows disagree about which
+  char filename[TEST_PATH_MAX];
+  test_path(filename, "test_write_image_filters.png");
+  const uint32_t sizes[][2] = { { 1, 1 }, { 5, 3 }, { 37, 20 }, { 300, 100 } };
+  const int levels[] = { 0, 1, 6, 9, -1 };
+  for (unsigned s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    uint32_t width = sizes[s][0], height = sizes[s][1];
+    struct Image img, loaded;
+    ASSERT(init_image(&img, width, height) == IMG_SUCCESS);
+    for (uint32_t y = 0; y < height; y++) {
+      for (uint32_t x = 0; x < width; x++) {
+        uint32_t i = y * width + x;
+        uint32_t color = ((x * 3) & 0xFF) << 24 | ((y * 5) & 0xFF) << 16 |
+                         ((x + y) & 0xFF) << 8 | ((255 - x) & 0xFF);
+        img.data[i] = (i % 13 == 0) ? test_pixel(i) : color;
+      }
+    }
+
+    long sizes_by_level[5];
+    for (int l = 0; l < 5; l++) {
+      set_image_compression_level(levels[l]);
+      ASSERT(write_image(filename, &img) == IMG_SUCCESS);
+      sizes_by_level[l] = file_size(filename);
+      ASSERT(read_image(filename, &loaded) == IMG_SUCCESS);
+      ASSERT(loaded.width == width && loaded.height == height);
+      ASSERT(memcmp(loaded.data, img.data, (size_t) width * height * sizeof(uint32_t)) == 0);
+      free(loaded.data);
+    }
+    // level 0 stores the rows as they are
+    ASSERT(sizes_by_level[0] > (long) width * height * 4);
+    if (width * height >= 100) {
+      ASSERT(sizes_by_level[3] < sizes_by_level[0] / 3);
+    }
+
+    free(img.data);
+  }
+  set_image_compression_level(-1);
+  remove(filename);
+}
+
+// the color type from a PNG file's IHDR chunk, which is followed by
+// the bit depth
+static int png_file_color_type(const char *filename, int *depth) {
+  unsigned char header[26];
+  FILE *f = fopen(filename, "rb");
+  ASSERT(f != NULL);
+  ASSERT(fread(header, 1, sizeof(header), f) == sizeof(header));
+  fclose(f);
+  *depth = header[24];
+  return header[25];
+}
+
+void test_write_image_opaque(TestObjs *objs) {
+  // odd sizes leave pixels over after the vectorized check
+  char filename[TEST_PATH_MAX];
+  test_path(filename, "test_write_image_opaque.png");
+  const uint32_t sizes[][2] = { { 1, 1 }, { 7, 5 }, { 33, 10 } };
+  for (unsigned s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    uint32_t width = sizes[s][0], height = sizes[s][1];
+    uint32_t num_pixels = width * height;
+    struct Image img, loaded;
+    int depth;
+    ASSERT(init_image(&img, width, height) == IMG_SUCCESS);
+    for (uint32_t i = 0; i < num_pixels; i++) {
+      img.data[i] = test_pixel(i) | 0xFF;
+    }
+
+    // an opaque image is written without its alpha channel...
+    ASSERT(write_image(filename, &img) == IMG_SUCCESS);
+    ASSERT(png_file_color_type(filename, &depth) == PNG_TRUECOLOR && depth == 8);
+    ASSERT(read_image(filename, &loaded) == IMG_SUCCESS);
+    ASSERT(loaded.width == width && loaded.height == height);
+    ASSERT(memcmp(loaded.data, img.data, num_pixels * sizeof(uint32_t)) == 0);
+    free(loaded.data);
+
+    // ...but one translucent pixel anywhere keeps it
+    for (uint32_t i = 0; i < num_pixels; i += 3) {
+      img.data[i] = img.data[i] & ~0x01U;
+      ASSERT(write_image(filename, &img) == IMG_SUCCESS);
+      ASSERT(png_file_color_type(filename, &depth) == PNG_TRUECOLOR_ALPHA);
+      ASSERT(read_image(filename, &loaded) == IMG_SUCCESS);
+      ASSERT(memcmp(loaded.data, img.data, num_pixels * sizeof(uint32_t)) == 0);
+      free(loaded.data);
+      img.data[i] |= 0xFF;
+    }
+
+    free(img.data);
+  }
+  remove(filename);
+}
+
+void test_write_image_palette(TestObjs *objs) {
+  // the odd width leaves part of a byte over at the end of each row
+  // at bit depths below 8
+  char filename[TEST_PATH_MAX];
+  test_path(filename, "test_write_image_palette.png");
+  const unsigned num_colors[] = { 1, 2, 3, 4, 5, 16, 17, 255, 256, 257 };
+  const int depths[] = { 1, 1, 2, 2, 4, 4, 8, 8, 8, 8 };
+  struct Image img, loaded;
+  ASSERT(init_image(&img, 41, 10) == IMG_SUCCESS);
+  set_image_palette(1);
+  for (unsigned c = 0; c < sizeof(num_colors) / sizeof(num_colors[0]); c++) {
+    for (uint32_t i = 0; i < 41 * 10; i++) {
+      img.data[i] = test_pixel((i * 7) % num_colors[c]);
+    }
+    ASSERT(write_image(filename, &img) == IMG_SUCCESS);
+
+    int depth;
+    if (num_colors[c] <= 256) {
+      ASSERT(png_file_color_type(filename, &depth) == PNG_INDEXED && depth == depths[c]);
+    } else {
+      ASSERT(png_file_color_type(filename, &depth) == PNG_TRUECOLOR_ALPHA && depth == 8);
+    }
+
+    ASSERT(read_image(filename, &loaded) == IMG_SUCCESS);
+    ASSERT(loaded.width == 41 && loaded.height == 10);
+    ASSERT(memcmp(loaded.data, img.data, 41 * 10 * sizeof(uint32_t)) == 0);
+    free(loaded.data);
+  }
+  set_image_palette(0);
+  free(img.data);
+  remove(filename);
+}
+
+void test_write_image_threads(TestObjs *objs) {
+  // several strips, the last of them partly filled, with and
+  // without compression
+  char filename[TEST_PATH_MAX];
+  test_path(filename, "test_write_image_threads.png");
+  const int levels[] = { 0, 1, -1 };
+  struct Image img, loaded;
+  ASSERT(init_image(&img, 301, 700) == IMG_SUCCESS);
+  for (uint32_t i = 0; i < 301 * 700; i++) {
+    img.data[i] = (i % 5 == 0) ? test_pixel(i) : (i / 301) << 24 | (i % 301) << 8 | 0x80;
+  }
+  ASSERT((size_t) 301 * 700 * 4 > 3 * PNG_STRIP_SIZE);
+
+  set_image_threads(3);
+  for (int l = 0; l < 3; l++) {
+    set_image_compression_level(levels[l]);
+    ASSERT(write_image(filename, &img) == IMG_SUCCESS);
+    ASSERT(read_image(filename, &loaded) == IMG_SUCCESS);
+    ASSERT(loaded.width == 301 && loaded.height == 700);
+    ASSERT(memcmp(loaded.data, img.data, 301 * 700 * sizeof(uint32_t)) == 0);
+    free(loaded.data);
+  }
+  set_image_compression_level(-1);
+  set_image_threads(1);
+  free(img.data);
+  remove(filename);
+}
+
+void test_image_formats(TestObjs *objs) {
+  char filenames[3][TEST_PATH_MAX];
+  test_path(filenames[0], "test_image_formats.qoi");
+  test_path(filenames[1], "test_image_formats.RGBA");
+  test_path(filenames[2], "test_image_formats.qoi.png");
+  const int formats[] = { IMAGE_FORMAT_QOI, IMAGE_FORMAT_RAW, IMAGE_FORMAT_PNG };
+  const char *magics[] = { "qoif", "CSFR", "\x89PNG" };
+  ASSERT(image_format_for_filename("/tmp/x.qoi/y") == IMAGE_FORMAT_PNG);
+
+  // runs, small and big steps, repeated colors and translucency
+  // exercise every QOI op
+  struct Image img, loaded;
+  ASSERT(init_image(&img, 67, 31) == IMG_SUCCESS);
+  for (uint32_t i = 0; i < 67 * 31; i++) {
+    switch (i % 7) {
+    case 0: img.data[i] = test_pixel(i); break;
+    case 1: img.data[i] = img.data[i - 1] + 0x01FF0000; break;
+    case 2: img.data[i] = img.data[i - 1] + 0x12100E00; break;
+    case 3: img.data[i] = test_pixel(i % 3); break;
+    default: img.data[i] = img.data[i - 1];
+    }
+  }
+
+  for (int opaque = 0; opaque <= 1; opaque++) {
+    for (int f = 0; f < 3; f++) {
+      ASSERT(image_format_for_filename(filenames[f]) == formats[f]);
+      ASSERT(write_image(filenames[f], &img) == IMG_SUCCESS);
+
+      char magic[4];
+      FILE *fp = fopen(filenames[f], "rb");
+      ASSERT(fp != NULL);
+      ASSERT(fread(magic, 1, 4, fp) == 4);
+      fclose(fp);
+      ASSERT(memcmp(magic, magics[f], 4) == 0);
+
+      ASSERT(read_image(filenames[f], &loaded) == IMG_SUCCESS);
+      ASSERT(loaded.width == 67 && loaded.height == 31);
+      ASSERT(memcmp(loaded.data, img.data, 67 * 31 * sizeof(uint32_t)) == 0);
+      free(loaded.data);
+    }
+    for (uint32_t i = 0; i < 67 * 31; i++) {
+      img.data[i] |= 0xFF;
+    }
+  }
+
+  // a raw image's pixels follow the header as they are in memory
+  size_t size = file_size(filenames[1]);
+  ASSERT(size == RAW_IMAGE_HEADER_SIZE + 67 * 31 * sizeof(uint32_t));
+  int fd = open(filenames[1], O_RDONLY);
+  ASSERT(fd >= 0);
+  uint8_t *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  ASSERT(data != MAP_FAILED);
+  ASSERT(memcmp(data + RAW_IMAGE_HEADER_SIZE, img.data, 67 * 31 * sizeof(uint32_t)) == 0);
+
+  // truncated files are rejected
+  ASSERT(decode_raw_image(data, size - 1, &loaded) == IMG_ERR_COULD_NOT_OPEN);
+  munmap(data, size);
+  ASSERT(write_image(filenames[0], &img) == IMG_SUCCESS);
+  fd = open(filenames[0], O_RDONLY);
+  size = file_size(filenames[0]);
+  data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  ASSERT(data != MAP_FAILED);
+  ASSERT(decode_qoi(data, size, &loaded) == IMG_SUCCESS);
+  free(loaded.data);
+  ASSERT(decode_qoi(data, size / 2, &loaded) == IMG_ERR_COULD_NOT_OPEN);
+  munmap(data, size);
+
+  free(img.data);
+  for (int f = 0; f < 3; f++) {
+    remove(filenames[f]);
+  }
+}
+
+void test_read_image_rgb(TestObjs *objs) {
+  // write_image only produces RGBA, so write the RGB (3 bytes per
+  // pixel) PNG with pnglite directly; its rows use every filter type
+  char filename[TEST_PATH_MAX];
+  test_path(filename, "test_read_image_rgb.png");
+  const uint32_t width = 41, height = 30;
+  unsigned char row[41 * 3];
+  png_t png;
+  png_init(0, 0);
+  ASSERT(png_open_file_write(&png, filename) == PNG_NO_ERROR);
+  ASSERT(png_write_begin(&png, width, height, 8, PNG_TRUECOLOR) == PNG_NO_ERROR);
+  for (uint32_t y = 0; y < height; y++) {
+    for (uint32_t x = 0; x < width; x++) {
+      uint32_t color = (x * y % 7 == 0) ? test_pixel(x + y * width) : (x * 5 + y) << 8;
+      row[x * 3 + 0] = color >> 24;
+      row[x * 3 + 1] = color >> 16;
+      row[x * 3 + 2] = color >> 8;
+    }
+    ASSERT(png_write_row(&png, row) == PNG_NO_ERROR);
+  }
+  ASSERT(png_write_end(&png) == PNG_NO_ERROR);
+  png_close_file(&png);
+
+  struct Image img;
+  ASSERT(read_image(filename, &img) == IMG_SUCCESS);
+  ASSERT(img.width == width && img.height == height);
+  for (uint32_t y = 0; y < height; y++) {
+    for (uint32_t x = 0; x < width; x++) {
+      uint32_t color = (x * y % 7 == 0) ? test_pixel(x + y * width) : (x * 5 + y) << 8;
+      ASSERT(img.data[y * width + x] == (color | 0xFF));
+    }
+  }
+
+  free(img.data);
+  remove(filename);
+}
+
+// a pnglite write callback that accepts only as many bytes as
+// *user_pointer allows
+static unsigned limited_write(void *input, size_t size, size_t numel, void *user_pointer) {
+  size_t *room = user_pointer;
+  size_t n = size * numel <= *room ? numel : *room / size;
+  *room -= n * size;
+  return n;
+}
+
+void test_png_write_begin_error(TestObjs *objs) {
+  // the signature, the IHDR length, the IHDR contents and its CRC
+  // each fail to be written in turn
+  const size_t limits[] = { 0, 8, 12, 29 };
+  png_init(0, 0);
+  for (unsigned i = 0; i < sizeof(limits) / sizeof(limits[0]); i++) {
+    size_t room = limits[i];
+    png_t png;
+    ASSERT(png_open_write(&png, limited_write, &room) == PNG_NO_ERROR);
+    ASSERT(png_write_begin(&png, 4, 4, 8, PNG_TRUECOLOR) == PNG_IO_ERROR);
+    png_write_end(&png);
+  }
+}
+
+void test_png_get_rgba(TestObjs *objs) {
+  char filename[TEST_PATH_MAX];
+  test_path(filename, "test_png_get_rgba.png");
+  const uint32_t width = 13, height = 9;
+  unsigned char row[13 * 4];
+  unsigned pixels[13 * 9];
+  png_init(0, 0);
+
+  // RGB and RGBA pngs, written with pnglite
+  for (int bpp = 3; bpp <= 4; bpp++) {
+    png_t png;
+    ASSERT(png_open_file_write(&png, filename) == PNG_NO_ERROR);
+    ASSERT(png_write_begin(&png, width, height, 8, bpp == 3 ? PNG_TRUECOLOR : PNG_TRUECOLOR_ALPHA)
+           == PNG_NO_ERROR);
+    for (uint32_t y = 0; y < height; y++) {
+      for (uint32_t x = 0; x < width; x++) {
+        uint32_t color = test_pixel(x + y * width);
+        for (int c = 0; c < bpp; c++) {
+          row[x * bpp + c] = color >> (24 - 8 * c);
+        }
+      }
+      ASSERT(png_write_row(&png, row) == PNG_NO_ERROR);
+    }
+    ASSERT(png_write_end(&png) == PNG_NO_ERROR);
+    png_close_file(&png);
+
+    // each pixel is one 0xRRGGBBAA value, opaque if there's no alpha
+    ASSERT(png_open_file_read(&png, filename) == PNG_NO_ERROR);
+    ASSERT(png.width == width && png.height == height);
+    ASSERT(png_get_rgba(&png, pixels) == PNG_NO_ERROR);
+    png_close_file(&png);
+    for (uint32_t i = 0; i < width * height; i++) {
+      uint32_t color = test_pixel(i);
+      ASSERT(pixels[i] == (bpp == 3 ? color | 0xFF : color));
+    }
+  }
+
+  remove(filename);
+}
+
+void test_read_image_truncated(TestObjs *objs) {
+  char filename[TEST_PATH_MAX];
+  test_path(filename, "test_read_image_truncated.png");
+  struct Image img;
+  ASSERT(init_image(&img, 20, 20) == IMG_SUCCESS);
+  for (uint32_t i = 0; i < 20 * 20; i++) {
+    img.data[i] = test_pixel(i);
+  }
+  set_image_compression_level(0);
+  ASSERT(write_image(filename, &img) == IMG_SUCCESS);
+  set_image_compression_level(PNG_DEFAULT_COMPRESSION);
+
+  // cut the image data in half, with a valid length and CRC, so the
+  // data ends before the last row
+  size_t size;
+  uint8_t *data = read_test_file(filename, &size);
+  size_t idat = find_png_chunk(data, size, "IDAT");
+  uint32_t length = (data[idat] << 24) | (data[idat + 1] << 16) | (data[idat + 2] << 8) | data[idat + 3];
+  ASSERT(idat + 12 + length < size);
+  size_t rest = idat + 12 + length;
+  length /= 2;
+  for (int i = 0; i < 4; i++) {
+    data[idat + i] = length >> (24 - 8 * i);
+  }
+  uint32_t crc = crc32(0, data + idat + 4, 4 + length);
+  for (int i = 0; i < 4; i++) {
+    data[idat + 8 + length + i] = crc >> (24 - 8 * i);
+  }
+  memmove(data + idat + 12 + length, data + rest, size - rest);
+  size -= rest - (idat + 12 + length);
+  write_test_data(filename, data, size);
+
+  png_t png;
+  unsigned pixels[20 * 20];
+  png_init(0, 0);
+  ASSERT(png_open_mem_read(&png, data, size) == PNG_NO_ERROR);
+  ASSERT(png_get_rgba(&png, pixels) == PNG_EOF_ERROR);
+  struct Image loaded;
+  ASSERT(read_image(filename, &loaded) != IMG_SUCCESS);
+
+  free(data);
+  free(img.data);
+  remove(filename);
+}
+
+void test_png_open_mem_read(TestObjs *objs) {
+  char filename[TEST_PATH_MAX];
+  test_path(filename, "test_png_open_mem_read.png");
+  struct Image img;
+  ASSERT(init_image(&img, 200, 150) == IMG_SUCCESS);
+  for (uint32_t i = 0; i < 200 * 150; i++) {
+    img.data[i] = test_pixel(i);
+  }
+  ASSERT(write_image(filename, &img) == IMG_SUCCESS);
+
+  FILE *f = fopen(filename, "rb");
+  ASSERT(f != NULL);
+  long size = file_size(filename);
+  unsigned char *contents = malloc(size);
+  ASSERT(fread(contents, 1, size, f) == (size_t) size);
+  fclose(f);
+
+  uint32_t *pixels = malloc(200 * 150 * sizeof(uint32_t));
+  png_t png;
+  ASSERT(png_open_mem_read(&png, contents, size) == PNG_NO_ERROR);
+  ASSERT(png.width == 200 && png.height == 150);
+  ASSERT(png_get_rgba(&png, (unsigned *) pixels) == PNG_NO_ERROR);
+  ASSERT(memcmp(pixels, img.data, 200 * 150 * sizeof(uint32_t)) == 0);
+
+  // a truncated png fails cleanly wherever it's cut off
+  for (long cut = 0; cut < size; cut += 997) {
+    if (png_open_mem_read(&png, contents, cut) == PNG_NO_ERROR) {
+      ASSERT(png_get_rgba(&png, (unsigned *) pixels) != PNG_NO_ERROR);
+    }
+  }
+
+  free(pixels);
+  free(contents);
+  free(img.data);
+  remove(filename);
+}
+
+void test_read_image_cached(TestObjs *objs) {
+  char filename[TEST_PATH_MAX], cache_dir[TEST_PATH_MAX];
+  test_path(filename, "test_read_image_cached.png");
+  test_path(cache_dir, "test_read_image_cached.d");
+  struct Image img, loaded;
+  void *mapping;
+  size_t mapping_size;
+  ASSERT(init_image(&img, 70, 50) == IMG_SUCCESS);
+  for (uint32_t i = 0; i < 70 * 50; i++) {
+    img.data[i] = test_pixel(i);
+  }
+  ASSERT(write_image(filename, &img) == IMG_SUCCESS);
+
+  // the first load decodes the PNG and fills the cache...
+  ASSERT(read_image_cached(cache_dir, filename, &loaded, &mapping, &mapping_size) == IMG_SUCCESS);
+  ASSERT(mapping == NULL);
+  ASSERT(loaded.width == 70 && loaded.height == 50);
+  ASSERT(memcmp(loaded.data, img.data, 70 * 50 * sizeof(uint32_t)) == 0);
+  free(loaded.data);
+
+  // ...and the second maps the cached pixels
+  ASSERT(read_image_cached(cache_dir, filename, &loaded, &mapping, &mapping_size) == IMG_SUCCESS);
+  ASSERT(mapping != NULL);
+  ASSERT(loaded.width == 70 && loaded.height == 50);
+  ASSERT(memcmp(loaded.data, img.data, 70 * 50 * sizeof(uint32_t)) == 0);
+  munmap(mapping, mapping_size);
+
+  // a changed PNG isn't served from the cache
+  img.data[0] = 0x12345678;
+  ASSERT(write_image(filename, &img) == IMG_SUCCESS);
+  struct timespec times[2] = { { 0, UTIME_OMIT }, { 1000000000, 0 } };
+  ASSERT(utimensat(AT_FDCWD, filename, times, 0) == 0);
+  ASSERT(read_image_cached(cache_dir, filename, &loaded, &mapping, &mapping_size) == IMG_SUCCESS);
+  ASSERT(mapping == NULL);
+  ASSERT(memcmp(loaded.data, img.data, 70 * 50 * sizeof(uint32_t)) == 0);
+  free(loaded.data);
+
+  // missing files are reported like read_image does
+  ASSERT(read_image_cached(cache_dir, "/tmp/no/such/file.png", &loaded, &mapping, &mapping_size)
+         == IMG_ERR_COULD_NOT_OPEN);
+
+  free(img.data);
+  remove(filename);
+  DIR *dir = opendir(cache_dir);
+  ASSERT(dir != NULL);
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", cache_dir, entry->d_name);
+    if (entry->d_name[0] != '.') {
+      remove(path);
+    }
+  }
+  closedir(dir);
+  ASSERT(rmdir(cache_dir) == 0);
+}
+
+static void write_test_file(const char *filename, const char *contents) {
+  FILE *f = fopen(filename, "w");
+  ASSERT(f != NULL);
+  fputs(contents, f);
+  fclose(f);
+}
+
+void test_render_batch(TestObjs *objs) {
+  char input1[TEST_PATH_MAX], input2[TEST_PATH_MAX], output1[TEST_PATH_MAX],
+    output2[TEST_PATH_MAX], output3[TEST_PATH_MAX], manifest[TEST_PATH_MAX];
+  test_path(input1, "test_render_batch1.in");
+  test_path(input2, "test_render_batch2.in");
+  test_path(output1, "test_render_batch1.png");
+  test_path(output2, "test_render_batch2.png");
+  test_path(output3, "test_render_batch3.png");
+  test_path(manifest, "test_render_batch.txt");
+
+  // both scenes draw the same shared image
+  write_test_file(input1, "S 20 10 L 0 img/NpcGuest.png P 0 0 0 4 4 1 1 R 10 0 2 2 ff0000ff\n");
+  write_test_file(input2, "S 8 6 L 2 img/NpcGuest.png P 2 0 0 4 4 0 0\n");
+  char contents[8 * TEST_PATH_MAX];
+  snprintf(contents, sizeof(contents),
+           "# comment\n"
+           "%s %s\n"
+           "\n"
+           "/tmp/no/such/file.in %s\n"
+           "%s /tmp/no/such/dir.png\n"
+           "  %s\t%s\n",
+           input1, output1, output3, input2, input2, output2);
+  write_test_file(manifest, contents);
+
+  struct BatchOptions options = { .num_threads = 2, .use_atlases = 1, .image_cache_dir = NULL };
+  // scenes that can't be read or written are counted as failures
+  ASSERT(render_batch(manifest, &options) == 2);
+
+  struct Image sprite, img;
+  ASSERT(read_image("img/NpcGuest.png", &sprite) == IMG_SUCCESS);
+  ASSERT(read_image(output1, &img) == IMG_SUCCESS);
+  ASSERT(img.width == 20 && img.height == 10);
+  ASSERT(img.data[10] == 0xFF0000FFU && img.data[20 + 11] == 0xFF0000FFU);
+  ASSERT(img.data[12] == 0x000000FFU);
+  ASSERT(img.data[20 + 1] == blend_colors(sprite.data[0], 0x000000FFU));
+  free(img.data);
+  ASSERT(read_image(output2, &img) == IMG_SUCCESS);
+  ASSERT(img.width == 8 && img.height == 6);
+  ASSERT(img.data[8 * 3 + 3] == blend_colors(sprite.data[sprite.width * 3 + 3], 0x000000FFU));
+  free(img.data);
+  free(sprite.data);
+
+  // a line with the wrong number of filenames rejects the manifest
+  snprintf(contents, sizeof(contents), "%s\n", input1);
+  write_test_file(manifest, contents);
+  ASSERT(render_batch(manifest, &options) == -1);
+  ASSERT(render_batch("/tmp/no/such/manifest.txt", &options) == -1);
+
+  remove(input1);
+  remove(input2);
+  remove(output1);
+  remove(output2);
+  remove(manifest);
+}
+
+// write a PNG whose chunks all have valid CRCs, but whose image data
+// is invalid deflate data
+static void write_corrupt_png(const char *filename) {
+  struct Image img;
+  ASSERT(init_image(&img, 4, 4) == IMG_SUCCESS);
+  ASSERT(write_image(filename, &img) == IMG_SUCCESS);
+  free(img.data);
+
+  size_t size;
+  uint8_t *data = read_test_file(filename, &size);
+  size_t idat = find_png_chunk(data, size, "IDAT");
+  uint32_t length = (data[idat] << 24) | (data[idat + 1] << 16) | (data[idat + 2] << 8) | data[idat + 3];
+  ASSERT(length > 2);
+  // after the zlib header, a final block of the reserved type 3
+  data[idat + 8 + 2] = 0x07;
+  uint32_t crc = crc32(0, data + idat + 4, 4 + length);
+  for (int i = 0; i < 4; i++) {
+    data[idat + 8 + length + i] = crc >> (24 - 8 * i);
+  }
+  write_test_data(filename, data, size);
+  free(data);
+}
+
+void test_write_raw_frame(TestObjs *objs) {
+  ASSERT(raw_frame_format_for_name("rgba") == RAW_FRAME_RGBA);
+  ASSERT(raw_frame_format_for_name("rgb") == RAW_FRAME_RGB);
+  ASSERT(raw_frame_format_for_name("abgr") == RAW_FRAME_ABGR);
+  ASSERT(raw_frame_format_for_name("png") == 0);
+
+  // big enough to take several buffers to convert
+  struct Image img;
+  ASSERT(init_image(&img, 301, 117) == IMG_SUCCESS);
+  size_t num_pixels = 301 * 117;
+  for (size_t i = 0; i < num_pixels; i++) {
+    img.data[i] = test_pixel(i);
+  }
+
+  char input1[TEST_PATH_MAX], input2[TEST_PATH_MAX], input3[TEST_PATH_MAX],
+    corrupt[TEST_PATH_MAX], output[TEST_PATH_MAX], stream[TEST_PATH_MAX], manifest[TEST_PATH_MAX];
+  test_path(input1, "test_write_raw_frame1.in");
+  test_path(input2, "test_write_raw_frame2.in");
+  test_path(input3, "test_write_raw_frame3.in");
+  test_path(corrupt, "test_write_raw_frame.png");
+  test_path(output, "test_write_raw_frame.raw");
+  test_path(stream, "test_write_raw_frame.out");
+  test_path(manifest, "test_write_raw_frame.txt");
+
+  const int formats[] = { RAW_FRAME_RGBA, RAW_FRAME_RGB, RAW_FRAME_ABGR };
+  const int order[][4] = { { 0, 1, 2, 3 }, { 0, 1, 2, -1 }, { 3, 2, 1, 0 } };
+  for (int f = 0; f < 3; f++) {
+    ASSERT(write_raw_frame_file(output, &img, formats[f]) == IMG_SUCCESS);
+    size_t size;
+    uint8_t *data = read_test_file(output, &size);
+    int bpp = order[f][3] < 0 ? 3 : 4;
+    ASSERT(size == num_pixels * bpp);
+    for (size_t i = 0; i < num_pixels; i++) {
+      for (int b = 0; b < bpp; b++) {
+        ASSERT(data[i * bpp + b] == (uint8_t) (img.data[i] >> (24 - 8 * order[f][b])));
+      }
+    }
+    free(data);
+  }
+  ASSERT(write_raw_frame_file("/tmp/no/such/dir.raw", &img, RAW_FRAME_RGBA) == IMG_ERR_COULD_NOT_OPEN);
+
+  // frames streamed to the standard output come out in the order of
+  // the manifest, leaving out scenes that fail (without writing
+  // anything else there, even when an image can't be decoded)
+  write_test_file(input1, "S 3 2 R 0 0 1 1 ff0000ff\n");
+  write_test_file(input2, "S 2 2 R 1 1 1 1 00ff00ff\n");
+  write_corrupt_png(corrupt);
+  char contents[8 * TEST_PATH_MAX];
+  snprintf(contents, sizeof(contents), "S 2 2 L 0 %s\n", corrupt);
+  write_test_file(input3, contents);
+  snprintf(contents, sizeof(contents),
+           "%s -\n"
+           "%s %s\n"
+           "/tmp/no/such/file.in -\n"
+           "%s -\n"
+           "%s -\n"
+           "%s -\n",
+           input1, input2, output, input2, input3, input1);
+  write_test_file(manifest, contents);
+  struct BatchOptions options = {
+    .num_threads = 3, .use_atlases = 0, .image_cache_dir = NULL, .raw_frame_format = RAW_FRAME_RGB,
+  };
+  fflush(stdout);
+  int saved_stdout = dup(STDOUT_FILENO);
+  int fd = open(stream, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  ASSERT(saved_stdout >= 0 && fd >= 0);
+  dup2(fd, STDOUT_FILENO);
+  close(fd);
+  int num_failed = render_batch(manifest, &options);
+  fflush(stdout);
+  dup2(saved_stdout, STDOUT_FILENO);
+  close(saved_stdout);
+  ASSERT(num_failed == 2);
+
+  const uint8_t frame1[] = { 255, 0, 0, 0, 0, 0, 0, 0, 0,
+                             0, 0, 0, 0, 0, 0, 0, 0, 0 };
+  const uint8_t frame2[] = { 0, 0, 0, 0, 0, 0,
+                             0, 0, 0, 0, 255, 0 };
+  size_t size;
+  uint8_t *data = read_test_file(stream, &size);
+  ASSERT(size == 2 * sizeof(frame1) + sizeof(frame2));
+  ASSERT(memcmp(data, frame1, sizeof(frame1)) == 0);
+  ASSERT(memcmp(data + sizeof(frame1), frame2, sizeof(frame2)) == 0);
+  ASSERT(memcmp(data + sizeof(frame1) + sizeof(frame2), frame1, sizeof(frame1)) == 0);
+  free(data);
+  data = read_test_file(output, &size);
+  ASSERT(size == sizeof(frame2) && memcmp(data, frame2, sizeof(frame2)) == 0);
+  free(data);
+
+  free(img.data);
+  remove(input1);
+  remove(input2);
+  remove(input3);
+  remove(corrupt);
+  remove(manifest);
+  remove(stream);
+  remove(output);
+}